@@ -0,0 +1,512 @@
+/*
+ * NAME
+ *     benchmark - time the gallant tools on reproducible inputs
+ *
+ * EXAMPLE USAGE
+ *     benchmark -n 7 -l "$(git rev-parse --short HEAD)" -o bench.csv
+ *     benchmark txttopng
+ *
+ * DESCRIPTION
+ *     Writes synthetic texts to a work directory: all ASCII, mixed Latin
+ *     and Greek, CJK double width, combining heavy, tab heavy and a few
+ *     huge single lines. txttopng renders each of them with gallant.hex;
+ *     srctohex reads gallant.src, hextosrc and hextobdf read gallant.hex.
+ *     Every case runs several times. The median and 95th percentile wall
+ *     time and the throughput in MB/s and glyphs/s are printed and appended
+ *     to a CSV file, one line per case, labelled so results of different
+ *     commits can be compared. Glyphs are codepoints for texts and glyph
+ *     definitions for fonts. The tools are run from the current directory.
+ *
+ *     The hex_decode micro benchmark times each implementation of
+ *     hex_decode() this CPU supports converting the bitmaps of gallant.hex
+ *     in memory, HEX_PASSES times over per run.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "hexdecode.h"
+
+#ifndef VERSION
+#define VERSION "(undefined)"
+#endif
+
+#define Runs          5
+#define WorkDirectory "bench.d"
+#define CsvFilename   "bench.csv"
+#define Label         "unlabelled"
+
+#define MAX_RUNS      1000
+#define MAX_PATH      1024
+#define MAX_ARGS      16
+#define TEXT_LINES    4000
+#define HEX_PASSES    100
+
+// A synthetic text: its name and the function writing it.
+struct text {
+    const char *name;
+    void    (*write)(FILE *aFile);
+};
+
+void    parse_options(int aArgc, char **aArgv);
+void    usage(int aStatus);
+void    errx(const char *aFormat, ...);
+void    write_ascii(FILE *aFile);
+void    write_latin_greek(FILE *aFile);
+void    write_cjk(FILE *aFile);
+void    write_combining(FILE *aFile);
+void    write_tabs(FILE *aFile);
+void    write_long_lines(FILE *aFile);
+void    put_utf8(FILE *aFile, uint32_t aCodepoint);
+uint32_t pick(uint32_t aFirst, uint32_t aLast);
+void    make_texts(void);
+void    bench(const char *aTool, const char *aInput, const char *aCommand, const char *aStdin,
+              size_t aBytes, size_t aGlyphs);
+double  run(char *const aArgv[], const char *aStdin);
+void    bench_hex(const char *aFilename);
+void    report(const char *aTool, const char *aInput, double aTimes[], size_t aBytes, size_t aGlyphs);
+double  seconds(void);
+void   *xmalloc(size_t aSize);
+size_t  count_codepoints(const char *aFilename);
+size_t  count_lines(const char *aFilename, const char *aPrefix, int aInvert);
+size_t  file_size(const char *aFilename);
+int     compare_doubles(const void *aFirst, const void *aSecond);
+int     selected(const char *aTool);
+FILE   *xfopen(const char *aFilename, const char *aMode);
+
+static const struct text gTexts[] = {
+    { "ascii", write_ascii },
+    { "latin-greek", write_latin_greek },
+    { "cjk", write_cjk },
+    { "combining", write_combining },
+    { "tabs", write_tabs },
+    { "long-lines", write_long_lines },
+};
+
+static unsigned int gRuns = Runs;
+static const char *gWorkDirectory = WorkDirectory;
+static const char *gCsvFilename = CsvFilename;
+static const char *gLabel = Label;
+static char **gTools = NULL;            // Tools to time; all if gToolCount is 0.
+static int gToolCount = 0;
+static uint32_t gSeed = 1;
+static FILE *gCsv = NULL;
+
+// Start the ball rolling.
+//
+int main(int aArgc, char **aArgv) {
+    char    path[MAX_PATH];
+    char    command[2 * MAX_PATH];
+    struct stat st;
+
+    parse_options(aArgc, aArgv);
+    make_texts();
+
+    const int empty = stat(gCsvFilename, &st) == -1 || st.st_size == 0;
+    gCsv = xfopen(gCsvFilename, "a");
+    if (empty)
+        fprintf(gCsv, "label,tool,input,bytes,glyphs,runs,median_s,p95_s,mb_per_s,glyphs_per_s\n");
+    printf("%-10s %-12s %10s %10s %10s %10s %12s\n", "tool", "input", "bytes", "median s", "p95 s", "MB/s",
+           "glyphs/s");
+    for (size_t i = 0; i < sizeof gTexts / sizeof gTexts[0]; ++i) {
+        snprintf(path, sizeof path, "%s/%s.txt", gWorkDirectory, gTexts[i].name);
+        snprintf(command, sizeof command, "./txttopng -f gallant.hex -t %s -p /dev/null", path);
+        bench("txttopng", gTexts[i].name, command, "/dev/null", file_size(path), count_codepoints(path));
+    }
+    const size_t src_glyphs = count_lines("gallant.src", "STARTCHAR", 0);
+    const size_t hex_glyphs = count_lines("gallant.hex", "#", 1);
+    bench("srctohex", "gallant.src", "./srctohex", "gallant.src", file_size("gallant.src"), src_glyphs);
+    bench("hextosrc", "gallant.hex", "./hextosrc", "gallant.hex", file_size("gallant.hex"), hex_glyphs);
+    bench("hextobdf", "gallant.hex", "./hextobdf", "gallant.hex", file_size("gallant.hex"), hex_glyphs);
+    bench_hex("gallant.hex");
+    if (fclose(gCsv) != 0)
+        errx("can't close %s: %s\n", gCsvFilename, strerror(errno));
+    return EXIT_SUCCESS;
+}
+
+// Time gRuns runs of aCommand, a program and arguments separated by spaces,
+// with stdin from aStdin. Report the result for aBytes of input holding
+// aGlyphs glyphs.
+//
+void bench(const char *aTool, const char *aInput, const char *aCommand, const char *aStdin, size_t aBytes,
+           size_t aGlyphs) {
+    double  times[MAX_RUNS];
+    char    command[2 * MAX_PATH];
+    char   *argv[MAX_ARGS];
+    size_t  argc = 0;
+
+    if (!selected(aTool))
+        return;
+    snprintf(command, sizeof command, "%s", aCommand);
+    for (char *arg = strtok(command, " "); arg != NULL && argc < MAX_ARGS - 1; arg = strtok(NULL, " "))
+        argv[argc++] = arg;
+    argv[argc] = NULL;
+    for (unsigned int i = 0; i < gRuns; ++i)
+        times[i] = run(argv, aStdin);
+    report(aTool, aInput, times, aBytes, aGlyphs);
+}
+
+// Time each hex_decode() implementation converting the bitmaps of the hex
+// font aFilename, one glyph at a time like the font loaders. The results
+// must agree with the first, scalar, implementation.
+//
+void bench_hex(const char *aFilename) {
+    const struct hex_decoder *decoders;
+    const size_t ndecoders = hex_decoders(&decoders);
+    double  times[MAX_RUNS];
+    char    line[MAX_PATH];
+    size_t  digits = 0, glyphs = 0;
+
+    if (!selected("hex_decode"))
+        return;
+    const size_t size = file_size(aFilename);
+    char   *const hex = xmalloc(size);
+    size_t *const lengths = xmalloc(size * sizeof *lengths);
+    FILE   *const fp = xfopen(aFilename, "r");
+    while (fgets(line, sizeof line, fp) != NULL) {
+        const char *const colon = strchr(line, ':');
+        if (line[0] == '#' || colon == NULL)
+            continue;
+        const size_t length = strcspn(colon + 1, "\n") & ~(size_t) 1;
+        memcpy(hex + digits, colon + 1, length);
+        digits += length;
+        lengths[glyphs++] = length;
+    }
+    fclose(fp);
+
+    uint8_t *const expected = xmalloc(digits / 2 + 1);
+    uint8_t *const bytes = xmalloc(digits / 2 + 1);
+    for (size_t d = 0; d < ndecoders; ++d) {
+        for (unsigned int i = 0; i < gRuns; ++i) {
+            const double start = seconds();
+            for (unsigned int pass = 0; pass < HEX_PASSES; ++pass) {
+                const char *in = hex;
+                uint8_t *out = bytes;
+                for (size_t g = 0; g < glyphs; ++g) {
+                    if (decoders[d].decode(out, in, lengths[g]) != lengths[g])
+                        errx("%s: hex_decode %s failed on glyph %zu\n", aFilename, decoders[d].name, g);
+                    in += lengths[g];
+                    out += lengths[g] / 2;
+                }
+            }
+            times[i] = seconds() - start;
+        }
+        if (d == 0)
+            memcpy(expected, bytes, digits / 2);
+        else if (memcmp(expected, bytes, digits / 2) != 0)
+            errx("hex_decode %s disagrees with %s\n", decoders[d].name, decoders[0].name);
+        report("hex_decode", decoders[d].name, times, HEX_PASSES * digits, HEX_PASSES * glyphs);
+    }
+    free(bytes);
+    free(expected);
+    free(lengths);
+    free(hex);
+}
+
+// Print and append to the CSV file the median and p95 of aTimes, gRuns
+// times for aBytes of input holding aGlyphs glyphs.
+//
+void report(const char *aTool, const char *aInput, double aTimes[], size_t aBytes, size_t aGlyphs) {
+    qsort(aTimes, gRuns, sizeof aTimes[0], compare_doubles);
+    const double median = gRuns % 2 ? aTimes[gRuns / 2] : (aTimes[gRuns / 2 - 1] + aTimes[gRuns / 2]) / 2;
+    const double p95 = aTimes[(95 * gRuns + 99) / 100 - 1];     // Nearest rank.
+    const double mbs = median > 0 ? (double) aBytes / median / 1e6 : 0;
+    const double gps = median > 0 ? (double) aGlyphs / median : 0;
+    printf("%-10s %-12s %10zu %10.4f %10.4f %10.1f %12.0f\n", aTool, aInput, aBytes, median, p95, mbs, gps);
+    fprintf(gCsv, "%s,%s,%s,%zu,%zu,%u,%.6f,%.6f,%.3f,%.0f\n", gLabel, aTool, aInput, aBytes, aGlyphs, gRuns,
+            median, p95, mbs, gps);
+}
+
+// Return the time from a monotonic clock in seconds.
+//
+double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+// Run aArgv once with stdin from aStdin and stdout and stderr discarded.
+// Return the wall clock time it took.
+//
+double run(char *const aArgv[], const char *aStdin) {
+    struct timespec start, end;
+    int     status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const pid_t pid = fork();
+    if (pid == -1)
+        errx("can't fork: %s\n", strerror(errno));
+    if (pid == 0) {
+        const int in = open(aStdin, O_RDONLY);
+        const int out = open("/dev/null", O_WRONLY);
+        if (in == -1 || out == -1 || dup2(in, 0) == -1 || dup2(out, 1) == -1 || dup2(out, 2) == -1)
+            _exit(126);
+        execv(aArgv[0], aArgv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) == -1)
+        errx("can't wait for %s: %s\n", aArgv[0], strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        errx("%s failed with status %d\n", aArgv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Write the synthetic texts to the work directory. The same seed always
+// produces the same texts.
+//
+void make_texts(void) {
+    char    path[MAX_PATH];
+
+    if (mkdir(gWorkDirectory, 0777) == -1 && errno != EEXIST)
+        errx("can't create %s: %s\n", gWorkDirectory, strerror(errno));
+    for (size_t i = 0; i < sizeof gTexts / sizeof gTexts[0]; ++i) {
+        snprintf(path, sizeof path, "%s/%s.txt", gWorkDirectory, gTexts[i].name);
+        FILE   *const fp = xfopen(path, "w");
+        gSeed = 1;
+        gTexts[i].write(fp);
+        if (fclose(fp) != 0)
+            errx("can't write %s: %s\n", path, strerror(errno));
+    }
+}
+
+// Lines of 79 printable ASCII characters.
+//
+void write_ascii(FILE *aFile) {
+    for (unsigned int line = 0; line < TEXT_LINES; ++line) {
+        for (unsigned int i = 0; i < 79; ++i)
+            putc((int) pick(0x20, 0x7E), aFile);
+        putc('\n', aFile);
+    }
+}
+
+// Lines of words, alternately Latin with Latin-1 letters and Greek.
+//
+void write_latin_greek(FILE *aFile) {
+    for (unsigned int line = 0; line < TEXT_LINES; ++line) {
+        for (unsigned int word = 0; word < 12; ++word) {
+            for (unsigned int i = pick(2, 6); i > 0; --i)
+                if (word % 2)
+                    put_utf8(aFile, pick(0x03B1, 0x03C9));
+                else
+                    put_utf8(aFile, pick(0, 7) ? pick('a', 'z') : pick(0x00E0, 0x00FF));
+            putc(' ', aFile);
+        }
+        putc('\n', aFile);
+    }
+}
+
+// Lines of 39 double width characters, katakana and CJK ideographs.
+//
+void write_cjk(FILE *aFile) {
+    for (unsigned int line = 0; line < TEXT_LINES; ++line) {
+        for (unsigned int i = 0; i < 39; ++i)
+            put_utf8(aFile, pick(0, 1) ? pick(0x30A1, 0x30F6) : pick(0x4E00, 0x9FFF));
+        putc('\n', aFile);
+    }
+}
+
+// Lines of 40 letters, each with one or two combining diacritical marks.
+//
+void write_combining(FILE *aFile) {
+    for (unsigned int line = 0; line < TEXT_LINES; ++line) {
+        for (unsigned int i = 0; i < 40; ++i) {
+            putc((int) pick('a', 'z'), aFile);
+            for (unsigned int marks = pick(1, 2); marks > 0; --marks)
+                put_utf8(aFile, pick(0x0300, 0x036F));
+        }
+        putc('\n', aFile);
+    }
+}
+
+// Lines of short words separated by one to three tabs.
+//
+void write_tabs(FILE *aFile) {
+    for (unsigned int line = 0; line < TEXT_LINES; ++line) {
+        for (unsigned int word = 0; word < 8; ++word) {
+            for (unsigned int i = pick(1, 5); i > 0; --i)
+                putc((int) pick('a', 'z'), aFile);
+            for (unsigned int tabs = pick(1, 3); tabs > 0; --tabs)
+                putc('\t', aFile);
+        }
+        putc('\n', aFile);
+    }
+}
+
+// Two lines of 100000 characters each.
+//
+void write_long_lines(FILE *aFile) {
+    for (unsigned int line = 0; line < 2; ++line) {
+        for (unsigned int i = 0; i < 100000; ++i)
+            put_utf8(aFile, pick(0, 15) ? pick(0x21, 0x7E) : pick(0x0391, 0x03A9));
+        putc('\n', aFile);
+    }
+}
+
+// Write aCodepoint UTF-8 encoded.
+//
+void put_utf8(FILE *aFile, uint32_t aCodepoint) {
+    if (aCodepoint < 0x80)
+        putc((int) aCodepoint, aFile);
+    else if (aCodepoint < 0x800) {
+        putc((int) (0xC0 | aCodepoint >> 6), aFile);
+        putc((int) (0x80 | (aCodepoint & 0x3F)), aFile);
+    }
+    else {
+        putc((int) (0xE0 | aCodepoint >> 12), aFile);
+        putc((int) (0x80 | (aCodepoint >> 6 & 0x3F)), aFile);
+        putc((int) (0x80 | (aCodepoint & 0x3F)), aFile);
+    }
+}
+
+// Return a pseudo random number from aFirst to aLast. A fixed generator,
+// so the texts do not depend on the C library.
+//
+uint32_t pick(uint32_t aFirst, uint32_t aLast) {
+    gSeed = gSeed * 1103515245u + 12345u;
+    return aFirst + (gSeed >> 8) % (aLast - aFirst + 1);
+}
+
+// Count the codepoints in a UTF-8 file.
+//
+size_t count_codepoints(const char *aFilename) {
+    FILE   *const fp = xfopen(aFilename, "rb");
+    size_t  codepoints = 0;
+    int     c;
+    while ((c = getc(fp)) != EOF)
+        if ((c & 0xC0) != 0x80)
+            ++codepoints;
+    fclose(fp);
+    return codepoints;
+}
+
+// Count the lines of a file that start with aPrefix, or with aInvert, the
+// lines that do not.
+//
+size_t count_lines(const char *aFilename, const char *aPrefix, int aInvert) {
+    FILE   *const fp = xfopen(aFilename, "r");
+    char    line[MAX_PATH];
+    size_t  lines = 0;
+    int     at_start = 1;
+    while (fgets(line, sizeof line, fp) != NULL) {
+        if (at_start && (strncmp(line, aPrefix, strlen(aPrefix)) == 0) != aInvert)
+            ++lines;
+        at_start = strchr(line, '\n') != NULL;
+    }
+    fclose(fp);
+    return lines;
+}
+
+// Return the size of a file in bytes.
+//
+size_t file_size(const char *aFilename) {
+    struct stat st;
+    if (stat(aFilename, &st) == -1)
+        errx("can't stat %s: %s\n", aFilename, strerror(errno));
+    return (size_t) st.st_size;
+}
+
+// Return whether aTool is to be timed.
+//
+int selected(const char *aTool) {
+    if (gToolCount == 0)
+        return 1;
+    for (int i = 0; i < gToolCount; ++i)
+        if (strcmp(gTools[i], aTool) == 0)
+            return 1;
+    return 0;
+}
+
+// Compare callback for qsort.
+//
+int compare_doubles(const void *aFirst, const void *aSecond) {
+    const double *first = aFirst, *second = aSecond;
+    return (*first > *second) - (*first < *second);
+}
+
+// Parse the command line options.
+//
+void parse_options(int aArgc, char **aArgv) {
+    int     ch;
+    while ((ch = getopt(aArgc, aArgv, "d:hl:n:o:V")) != -1) {
+        switch (ch) {
+        case 'V':
+            printf("%s version %s\n", aArgv[0], VERSION);
+            exit (EXIT_SUCCESS);
+            break;
+        case 'd':
+            gWorkDirectory = optarg;
+            break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+            break;
+        case 'l':
+            gLabel = optarg;
+            break;
+        case 'n':
+            if (sscanf(optarg, "%u", &gRuns) != 1 || gRuns == 0 || gRuns > MAX_RUNS)
+                errx("can't convert '%s' to a number of runs from 1 to %d\n", optarg, MAX_RUNS);
+            break;
+        case 'o':
+            gCsvFilename = optarg;
+            break;
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+    gTools = aArgv + optind;
+    gToolCount = aArgc - optind;
+}
+
+// Output usage message and exit with status.
+//
+void usage(int aStatus) {
+    fprintf(stderr, "usage: benchmark [options] [tool ...]\n");
+    fprintf(stderr, "Options [default]:\n");
+    fprintf(stderr, "  -d directory   work directory for the synthetic texts [%s]\n", WorkDirectory);
+    fprintf(stderr, "  -h             show this help text\n");
+    fprintf(stderr, "  -l label       label of the CSV lines, e.g. a commit [%s]\n", Label);
+    fprintf(stderr, "  -n runs        runs per case [%d]\n", Runs);
+    fprintf(stderr, "  -o csvfile     CSV file to append to [%s]\n", CsvFilename);
+    fprintf(stderr, "  -V             output version and exit\n");
+    fprintf(stderr, "\nTimes txttopng, srctohex, hextosrc, hextobdf and hex_decode, or the given tools\n");
+    exit(aStatus);
+}
+
+// Allocate memory and exit on failure.
+//
+void   *xmalloc(size_t aSize) {
+    void   *const mem = malloc(aSize);
+    if (mem == NULL)
+        errx("failed to allocate %zu bytes\n", aSize);
+    return mem;
+}
+
+// Open file and exit on failure.
+//
+FILE   *xfopen(const char *aFilename, const char *aMode) {
+    FILE   *const fp = fopen(aFilename, aMode);
+    if (fp == NULL)
+        errx("can't open(%s,%s): %s\n", aFilename, aMode, strerror(errno));
+    return fp;
+}
+
+// Print formatted message on stderr and exit.
+//
+void errx(const char *aFormat, ...) {
+    va_list ap;
+    va_start(ap, aFormat);
+    vfprintf(stderr, aFormat, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+/* vim: set tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
@@ -0,0 +1,17 @@
+/*
+ * cellwidth.h - character cell width of Unicode codepoints
+ *
+ * The table in cellwidth.c is generated by ucdtowidth from the Unicode
+ * Character Database, so all tools classify characters the same way on
+ * every host, independent of the C library and the locale.
+ */
+#ifndef CELLWIDTH_H
+#define CELLWIDTH_H
+
+#include <stdint.h>
+
+int     cell_width(uint32_t aCodepoint);
+
+#endif
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
@@ -0,0 +1,45 @@
+/*
+ * gfi.h - layout of a gallant font image (.gfi)
+ *
+ * A font image is a binary rendition of a hex font that can be mapped into
+ * memory and used as is, without parsing. It is created by hextogfi and
+ * read by txttopng. All offsets are relative to the start of the file, so
+ * the image can be mapped at any address. Numbers are in the byte order of
+ * the host that created the image; byte_order tells a reader whether it can
+ * use the image.
+ *
+ * Layout, each section aligned to GFI_ALIGN bytes:
+ *   struct gfi_header
+ *   uint32_t codepoints[glyphs]   sorted ascending, no duplicates
+ *   uint8_t  cells[glyphs]        1 for single width, 2 for double width
+ *   uint32_t offsets[glyphs]      bitmap offset relative to the bitmaps section
+ *   uint8_t  bitmaps[]            height rows of (cells * width + 7) / 8 bytes
+ */
+#ifndef GFI_H
+#define GFI_H
+
+#include <stdint.h>
+
+#define GFI_MAGIC       "GALLANT\x1a"
+#define GFI_MAGIC_SIZE  8
+#define GFI_VERSION     1
+#define GFI_BYTE_ORDER  0x01020304u
+#define GFI_ALIGN       8
+
+struct gfi_header {
+    char    magic[GFI_MAGIC_SIZE];
+    uint32_t byte_order;               // GFI_BYTE_ORDER as written by the creator
+    uint32_t version;                  // GFI_VERSION
+    uint32_t width;                    // Pixels per cell.
+    uint32_t height;                   // Pixel rows per glyph.
+    uint32_t glyphs;
+    uint32_t codepoints;               // Offset of the codepoints section.
+    uint32_t cells;                    // Offset of the cells section.
+    uint32_t offsets;                  // Offset of the offsets section.
+    uint32_t bitmaps;                  // Offset of the bitmaps section.
+    uint32_t size;                     // Size of the whole image.
+};
+
+#endif
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
@@ -0,0 +1,150 @@
+/*
+ * hexdecode.c - validate and convert the hex digits of font bitmaps
+ *
+ * The vector versions check and convert 16 (SSE2) or 32 (AVX2) digits at a
+ * time: a digit is valid if it is in '0'-'9' or, with the case bit set, in
+ * 'a'-'f'. Each pair of nibbles is then combined into a byte within its
+ * 16-bit lane and the lanes are packed to bytes. Digits left over at the
+ * end go through the table driven scalar version.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hexdecode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define HEX_X86 1
+#include <immintrin.h>
+#endif
+
+static size_t hex_decode_scalar(uint8_t *aOut, const char *aHex, size_t aDigits);
+#ifdef HEX_X86
+static size_t hex_decode_sse2(uint8_t *aOut, const char *aHex, size_t aDigits);
+static size_t hex_decode_avx2(uint8_t *aOut, const char *aHex, size_t aDigits);
+#endif
+
+// Value plus one of each hex digit; 0 for all other characters.
+static const uint8_t gNibble[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+// Implementations from slowest to fastest.
+static const struct hex_decoder gDecoders[] = {
+    { "scalar", hex_decode_scalar },
+#ifdef HEX_X86
+    { "sse2", hex_decode_sse2 },
+    { "avx2", hex_decode_avx2 },
+#endif
+};
+
+// Chosen on first use. Threads racing to choose all store the same one.
+static hex_decoder_fn *gDecode = NULL;
+
+// Decode with the fastest implementation this CPU supports.
+//
+size_t hex_decode(uint8_t *aOut, const char *aHex, size_t aDigits) {
+    hex_decoder_fn *decode = __atomic_load_n(&gDecode, __ATOMIC_RELAXED);
+    if (decode == NULL) {
+        const struct hex_decoder *decoders;
+        const size_t n = hex_decoders(&decoders);
+        decode = decoders[n - 1].decode;
+        __atomic_store_n(&gDecode, decode, __ATOMIC_RELAXED);
+    }
+    return decode(aOut, aHex, aDigits);
+}
+
+// Point *aDecoders at the implementations this CPU supports, slowest
+// first, and return how many there are.
+//
+size_t hex_decoders(const struct hex_decoder **aDecoders) {
+    size_t  n = sizeof gDecoders / sizeof gDecoders[0];
+#ifdef HEX_X86
+    if (!__builtin_cpu_supports("avx2"))
+        --n;
+#endif
+    *aDecoders = gDecoders;
+    return n;
+}
+
+// Decode a pair of digits at a time through gNibble.
+//
+static size_t hex_decode_scalar(uint8_t *aOut, const char *aHex, size_t aDigits) {
+    for (size_t i = 0; i + 1 < aDigits; i += 2) {
+        const unsigned int hi = gNibble[(unsigned char) aHex[i]];
+        const unsigned int lo = gNibble[(unsigned char) aHex[i + 1]];
+        if (hi == 0)
+            return i;
+        if (lo == 0)
+            return i + 1;
+        aOut[i / 2] = (uint8_t) ((hi - 1) << 4 | (lo - 1));
+    }
+    return aDigits;
+}
+
+#ifdef HEX_X86
+
+// Decode 16 digits at a time.
+//
+static size_t hex_decode_sse2(uint8_t *aOut, const char *aHex, size_t aDigits) {
+    const __m128i below_0 = _mm_set1_epi8('0' - 1), above_9 = _mm_set1_epi8('9' + 1);
+    const __m128i below_a = _mm_set1_epi8('a' - 1), above_f = _mm_set1_epi8('f' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i digit_base = _mm_set1_epi8('0'), letter_base = _mm_set1_epi8('a' - 10);
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    size_t  i = 0;
+
+    for (; i + 16 <= aDigits; i += 16) {
+        const __m128i c = _mm_loadu_si128((const __m128i *) (aHex + i));
+        const __m128i lc = _mm_or_si128(c, case_bit);
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_0), _mm_cmplt_epi8(c, above_9));
+        const __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lc, below_a), _mm_cmplt_epi8(lc, above_f));
+        const unsigned int bad = ~(unsigned int) _mm_movemask_epi8(_mm_or_si128(digit, letter)) & 0xFFFFu;
+        if (bad != 0)
+            return i + (size_t) __builtin_ctz(bad);
+        const __m128i nibbles = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, digit_base)),
+                                             _mm_and_si128(letter, _mm_sub_epi8(lc, letter_base)));
+        const __m128i bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibbles, low_byte), 4),
+                                           _mm_srli_epi16(nibbles, 8));
+        _mm_storel_epi64((__m128i *) (aOut + i / 2), _mm_packus_epi16(bytes, bytes));
+    }
+    return i + hex_decode_scalar(aOut + i / 2, aHex + i, aDigits - i);
+}
+
+// Decode 32 digits at a time.
+//
+__attribute__((target("avx2")))
+static size_t hex_decode_avx2(uint8_t *aOut, const char *aHex, size_t aDigits) {
+    const __m256i below_0 = _mm256_set1_epi8('0' - 1), nine = _mm256_set1_epi8('9');
+    const __m256i below_a = _mm256_set1_epi8('a' - 1), f = _mm256_set1_epi8('f');
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i digit_base = _mm256_set1_epi8('0'), letter_base = _mm256_set1_epi8('a' - 10);
+    const __m256i low_byte = _mm256_set1_epi16(0x00FF);
+    size_t  i = 0;
+
+    for (; i + 32 <= aDigits; i += 32) {
+        const __m256i c = _mm256_loadu_si256((const __m256i *) (aHex + i));
+        const __m256i lc = _mm256_or_si256(c, case_bit);
+        const __m256i digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(c, nine), _mm256_cmpgt_epi8(c, below_0));
+        const __m256i letter = _mm256_andnot_si256(_mm256_cmpgt_epi8(lc, f), _mm256_cmpgt_epi8(lc, below_a));
+        const unsigned int bad = ~(unsigned int) _mm256_movemask_epi8(_mm256_or_si256(digit, letter));
+        if (bad != 0)
+            return i + (size_t) __builtin_ctz(bad);
+        const __m256i nibbles = _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, digit_base)),
+                                                _mm256_and_si256(letter, _mm256_sub_epi8(lc, letter_base)));
+        const __m256i bytes = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nibbles, low_byte), 4),
+                                              _mm256_srli_epi16(nibbles, 8));
+        _mm_storeu_si128((__m128i *) (aOut + i / 2),
+                         _mm_packus_epi16(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1)));
+    }
+    // Leave the upper halves clean for the SSE2 code, or each of its
+    // instructions pays for an AVX to SSE transition.
+    _mm256_zeroupper();
+    return i + hex_decode_sse2(aOut + i / 2, aHex + i, aDigits - i);
+}
+
+#endif
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
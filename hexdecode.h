@@ -0,0 +1,29 @@
+/*
+ * hexdecode.h - validate and convert the hex digits of font bitmaps
+ *
+ * hex_decode() uses the fastest implementation the CPU supports: AVX2 or
+ * SSE2 on x86, chosen at run time, else plain C. All implementations give
+ * the same results; hex_decoders() lists them for benchmarks.
+ */
+#ifndef HEXDECODE_H
+#define HEXDECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A hex decoder: converts aDigits hex digits from aHex, an even number, to
+// aDigits / 2 bytes in aOut. Returns aDigits, or the offset of the first
+// character that is not a hex digit. aOut is undefined after an error.
+typedef size_t hex_decoder_fn(uint8_t *aOut, const char *aHex, size_t aDigits);
+
+struct hex_decoder {
+    const char *name;
+    hex_decoder_fn *decode;
+};
+
+size_t  hex_decode(uint8_t *aOut, const char *aHex, size_t aDigits);
+size_t  hex_decoders(const struct hex_decoder **aDecoders);
+
+#endif
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
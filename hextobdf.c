@@ -13,63 +13,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <string.h>
 #include <inttypes.h>
 #include <locale.h>
-#include <wchar.h>
 #include <unistd.h>
 
+#include "cellwidth.h"
+#include "libgallant.h"
+
 #ifndef VERSION
 #define VERSION "(undefined)"
 #endif
 
 #define PixelWidth 12
 #define PixelHeight 22
-#define MAX_LINE 1024
-#define MAX_GLYPHS 131072
-
-struct glyph {
-    wint_t  codepoint;
-    char   *bitmap;
-};
-
 void    parse_options(int aArgc, char **aArgv);
 void    usage(int aStatus);
 void    errx(const char *aFormat, ...);
-void    parse_font_dimensions(FILE *aFile);
-void    parse_font_line(const char *aLine, struct glyph *aGlyph);
+void    check_font(void);
 void    output_bdf_preamble(void);
-void    output_bdf_char(int aChar);
-void   *xmalloc(size_t aSize);
+void    output_bdf_char(unsigned int aGlyph);
 
 size_t  gWidth = PixelWidth;
 size_t  gHeight = PixelHeight;
-size_t  gLineNr = 0;
-size_t  gBytes = 0;            // per one row of pixels in a regular glyph
-size_t  gDblBytes = 0;         // per one row of pixels in a dbl width glyph
-struct glyph *gGlyph = NULL;
-int     gGlyphs = 0;
+struct font *gFont = NULL;
+unsigned int gGlyphs = 0;              // Those of the font, without a replacement it lacks.
 
 // start the ball rolling.
 //
 int main(int aArgc, char **aArgv) {
     if (!setlocale(LC_CTYPE, ""))
         errx("Can't set the locale. Check LANG, LC_CTYPE, LC_ALL.\n");
-    gGlyph = xmalloc(MAX_GLYPHS * sizeof *gGlyph);
     parse_options(aArgc, aArgv);
-    parse_font_dimensions(stdin);
-    char    buf[MAX_LINE];
-    while (fgets(buf, MAX_LINE, stdin)) {
-        ++gLineNr;
-        parse_font_line(buf, &gGlyph[gGlyphs]);
-        ++gGlyphs;
-    }
-    fprintf(stderr, "found %d glyphs\n", gGlyphs);
+    char    error[FONT_ERROR_SIZE];
+    gFont = font_read_hex(stdin, "stdin", error);
+    if (gFont == NULL)
+        errx("%s\n", error);
+    if (error[0] != '\0')
+        fprintf(stderr, "%s\n", error);
+    check_font();
+    fprintf(stderr, "found %u glyphs\n", gGlyphs);
     output_bdf_preamble();
-    for (int i = 0; i < gGlyphs; ++i) {
+    for (unsigned int i = 0; i < gGlyphs; ++i) {
         output_bdf_char(i);
     }
     puts("ENDFONT");
+    font_close(gFont);
     return EXIT_SUCCESS;
 }
 
@@ -100,28 +88,25 @@ void output_bdf_preamble(void) {
     puts("FONT_DESCENT 5");
     puts("DEFAULT_CHAR 65533");
     puts("ENDPROPERTIES");
-    printf("CHARS %d\n", gGlyphs);
+    printf("CHARS %u\n", gGlyphs);
 }
 
 // Output data for a single STARTCHAR to stdout.
 //
-void output_bdf_char(int aChar) {
-    size_t  hexdigits;
-    printf("STARTCHAR U%04x\n", gGlyph[aChar].codepoint);
-    printf("ENCODING %d\n", gGlyph[aChar].codepoint);
-    if (wcwidth(gGlyph[aChar].codepoint) == 2) {
+void output_bdf_char(unsigned int aGlyph) {
+    const uint32_t codepoint = gFont->codepoint[aGlyph];
+    printf("STARTCHAR U%04" PRIx32 "\n", codepoint);
+    printf("ENCODING %" PRIu32 "\n", codepoint);
+    if (gFont->cells[aGlyph] == 2)
         puts("SWIDTH 1000 0\nDWIDTH 24 0\nBBX 24 22 0 -5");
-        hexdigits = 2 * gDblBytes;
-    }
-    else {
+    else
         puts("SWIDTH 500 0\nDWIDTH 12 0\nBBX 12 22 0 -5");
-        hexdigits = 2 * gBytes;
-    }
     puts("BITMAP");
-    const char *p = gGlyph[aChar].bitmap;
+    const unsigned int bytes = font_row_bytes(gFont, aGlyph);
+    const uint8_t *p = font_bitmap(gFont, aGlyph);
     for (size_t h = 0; h < gHeight; ++h) {
-        for (size_t i = 0; i < hexdigits; ++i) {
-            putchar(*p);
+        for (unsigned int i = 0; i < bytes; ++i) {
+            printf("%02x", *p);
             ++p;
         }
         putchar('\n');
@@ -129,27 +114,19 @@ void output_bdf_char(int aChar) {
     puts("ENDCHAR");
 }
 
-// Parse one line of font hex data and store result in glyph.
+// Check that the font has the gallant font's dimensions, and that its
+// glyphs are as wide as cell_width() says.
 //
-void parse_font_line(const char *aLine, struct glyph *aGlyph) {
-    char    c;
-    if (sscanf(aLine, "%" SCNx32 "%c", &aGlyph->codepoint, &c) == 2 && c == ':') {
-        const char *colon = strchr(aLine, ':');
-        const size_t hexlen = strlen(colon + 1) - 1;    // Minus newline.
-
-        if (wcwidth(aGlyph->codepoint) == 2) {
-            if (hexlen != gHeight * gDblBytes * 2)
-                errx("line %d: expected %zu hexdigits for double width glyph, got %zu\n", gLineNr, gHeight * gDblBytes * 2, hexlen);
-        }
-        else {
-            if (hexlen != gHeight * gBytes * 2)
-                errx("line %d: expected %zu hexdigits for normal width glyph, got %zu\n", gLineNr, gHeight * gBytes * 2, hexlen);
-        }
-        aGlyph->bitmap = xmalloc(hexlen);
-        memcpy(aGlyph->bitmap, colon + 1, hexlen);
+void check_font(void) {
+    if (gFont->width != PixelWidth || gFont->height != PixelHeight)
+        errx("dimensions do not match gallant font's 12x22\n");
+    gGlyphs = gFont->glyphs;
+    for (unsigned int i = 0; i < gGlyphs; ++i) {
+        const uint32_t codepoint = gFont->codepoint[i];
+        const unsigned int cells = cell_width(codepoint) == 2 ? 2 : 1;
+        if (gFont->cells[i] != cells)
+            errx("U+%04" PRIX32 ": expected %s width glyph\n", codepoint, cells == 2 ? "double" : "normal");
     }
-    else
-        errx("expected codepoint:hexdata in line %d\n", gLineNr);
 }
 
 // Parse the command line options.
@@ -178,26 +155,6 @@ void parse_options(int aArgc, char **aArgv) {
         errx("dimensions do not match gallant font's 12x22\n");
 }
 
-// Parse the font's Width: and Height: directives.
-//
-void parse_font_dimensions(FILE *aFile) {
-    char    line[MAX_LINE] = { 0 };
-    for (int i = 1; i <= 2; ++i) {
-        if (fgets(line, sizeof line, aFile) != NULL) {
-            if (sscanf(line, " # Width: %zu", &gWidth) != 1)
-                if (sscanf(line, " # Height: %zu", &gHeight) != 1)
-                    errx("line %d must be '# Width or Height: number'\n", i);
-        }
-        else
-            errx("could not read line %d\n", i);
-    }
-    if (gWidth != PixelWidth || gHeight != PixelHeight)
-        errx("dimensions do not match gallant font's 12x22\n");
-    gBytes = (gWidth + 7) / 8;
-    gDblBytes = (2 * gWidth + 7) / 8;
-}
-
-
 // Output usage message and exit with status.
 //
 void usage(int aStatus) {
@@ -210,15 +167,6 @@ void usage(int aStatus) {
     exit(aStatus);
 }
 
-// Allocate memory and exit on failure.
-//
-void   *xmalloc(size_t aSize) {
-    void   *const mem = malloc(aSize);
-    if (mem == NULL)
-        errx("failed to allocate %zu bytes\n", aSize);
-    return mem;
-}
-
 // Print formatted message on stderr and exit.
 //
 void errx(const char *aFormat, ...) {
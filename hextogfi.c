@@ -0,0 +1,204 @@
+/*
+ * NAME
+ *     hextogfi - compile font from hex format to a gallant font image
+ *
+ * EXAMPLE USAGE
+ *     hextogfi < gallant.hex > gallant.gfi
+ *     hextogfi -c < gallant.hex > gallant.h
+ *
+ * DESCRIPTION
+ *     The font image holds the font's dimensions, a sorted codepoint
+ *     index, the cell width of each glyph and the packed bitmaps, laid out
+ *     as described in gfi.h. Programs can map it into memory and use it
+ *     without any parsing. The image uses the byte order of the host.
+ *
+ *     With -c the same tables are written as a C header of const arrays
+ *     instead, for programs to compile the font in, like the Sun console
+ *     did with gallant19.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "gfi.h"
+#include "libgallant.h"
+
+#ifndef VERSION
+#define VERSION "(undefined)"
+#endif
+
+void    parse_options(int aArgc, char **aArgv);
+void    usage(int aStatus);
+void    errx(const char *aFormat, ...);
+void    output_image(void);
+void    output_header(void);
+uint32_t bitmap_size(uint32_t aGlyph);
+void    output_padding(uint32_t aOffset);
+uint32_t align(uint32_t aOffset);
+
+int     gHeader = 0;                   // -c: write a C header
+struct font *gFont = NULL;
+uint32_t gGlyphs = 0;                  // Those of the font, without a replacement it lacks.
+
+// start the ball rolling.
+//
+int main(int aArgc, char **aArgv) {
+    char    error[FONT_ERROR_SIZE];
+    parse_options(aArgc, aArgv);
+    gFont = font_read_hex(stdin, "stdin", error);
+    if (gFont == NULL)
+        errx("%s\n", error);
+    if (error[0] != '\0')
+        fprintf(stderr, "%s\n", error);
+    gGlyphs = gFont->glyphs;
+    fprintf(stderr, "found %" PRIu32 " glyphs\n", gGlyphs);
+    if (gHeader)
+        output_header();
+    else
+        output_image();
+    font_close(gFont);
+    return EXIT_SUCCESS;
+}
+
+// Write header, codepoints, cells, offsets and bitmaps to stdout.
+//
+void output_image(void) {
+    struct gfi_header header;
+    uint32_t bitmap_bytes = 0;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, GFI_MAGIC, GFI_MAGIC_SIZE);
+    header.byte_order = GFI_BYTE_ORDER;
+    header.version = GFI_VERSION;
+    header.width = gFont->width;
+    header.height = gFont->height;
+    header.glyphs = gGlyphs;
+    header.codepoints = align(sizeof header);
+    header.cells = align(header.codepoints + gGlyphs * sizeof (uint32_t));
+    header.offsets = align(header.cells + gGlyphs);
+    header.bitmaps = align(header.offsets + gGlyphs * sizeof (uint32_t));
+    for (uint32_t i = 0; i < gGlyphs; ++i)
+        bitmap_bytes += bitmap_size(i);
+    header.size = header.bitmaps + bitmap_bytes;
+
+    fwrite(&header, sizeof header, 1, stdout);
+    output_padding(sizeof header);
+    for (uint32_t i = 0; i < gGlyphs; ++i)
+        fwrite(&gFont->codepoint[i], sizeof gFont->codepoint[i], 1, stdout);
+    output_padding(header.codepoints + gGlyphs * sizeof (uint32_t));
+    for (uint32_t i = 0; i < gGlyphs; ++i)
+        putchar(gFont->cells[i]);
+    output_padding(header.cells + gGlyphs);
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < gGlyphs; ++i) {
+        fwrite(&offset, sizeof offset, 1, stdout);
+        offset += bitmap_size(i);
+    }
+    output_padding(header.offsets + gGlyphs * sizeof (uint32_t));
+    for (uint32_t i = 0; i < gGlyphs; ++i)
+        fwrite(font_bitmap(gFont, i), bitmap_size(i), 1, stdout);
+    if (fflush(stdout) != 0 || ferror(stdout))
+        errx("error writing font image\n");
+    fprintf(stderr, "wrote %" PRIu32 " bytes\n", header.size);
+}
+
+// Write the codepoints, cells, offsets and bitmaps as static const arrays
+// of a C header to stdout, with the dimensions as macros. The bitmaps get
+// one line per glyph.
+//
+void output_header(void) {
+    uint32_t bitmap_bytes = 0;
+
+    printf("/*\n * Font tables generated by hextogfi -c, laid out like the sections of a\n");
+    printf(" * font image described in gfi.h. Do not edit.\n */\n");
+    printf("#define BUILTIN_WIDTH   %" PRIu32 "\n", gFont->width);
+    printf("#define BUILTIN_HEIGHT  %" PRIu32 "\n", gFont->height);
+    printf("#define BUILTIN_GLYPHS  %" PRIu32 "\n\n", gGlyphs);
+    printf("static const uint32_t builtin_codepoints[BUILTIN_GLYPHS] = {");
+    for (uint32_t i = 0; i < gGlyphs; ++i)
+        printf("%s0x%04" PRIx32 ",", i % 8 == 0 ? "\n    " : " ", gFont->codepoint[i]);
+    printf("\n};\n\nstatic const uint8_t builtin_cells[BUILTIN_GLYPHS] = {");
+    for (uint32_t i = 0; i < gGlyphs; ++i)
+        printf("%s%u,", i % 16 == 0 ? "\n    " : " ", gFont->cells[i]);
+    printf("\n};\n\nstatic const uint32_t builtin_offsets[BUILTIN_GLYPHS] = {");
+    for (uint32_t i = 0; i < gGlyphs; ++i) {
+        printf("%s%" PRIu32 ",", i % 8 == 0 ? "\n    " : " ", bitmap_bytes);
+        bitmap_bytes += bitmap_size(i);
+    }
+    printf("\n};\n\nstatic const uint8_t builtin_bitmaps[%" PRIu32 "] = {\n", bitmap_bytes);
+    for (uint32_t i = 0; i < gGlyphs; ++i) {
+        const uint8_t *const bitmap = font_bitmap(gFont, i);
+        printf("    /* U+%04" PRIX32 " */", gFont->codepoint[i]);
+        for (uint32_t b = 0; b < bitmap_size(i); ++b)
+            printf(" 0x%02x,", bitmap[b]);
+        putchar('\n');
+    }
+    printf("};\n");
+    if (fflush(stdout) != 0 || ferror(stdout))
+        errx("error writing font header\n");
+    fprintf(stderr, "wrote %" PRIu32 " bytes of bitmaps\n", bitmap_bytes);
+}
+
+// Return the bitmap size of aGlyph.
+//
+uint32_t bitmap_size(uint32_t aGlyph) {
+    return gFont->height * font_row_bytes(gFont, aGlyph);
+}
+
+// Write zero bytes from aOffset up to the next section boundary.
+//
+void output_padding(uint32_t aOffset) {
+    for (uint32_t i = aOffset; i < align(aOffset); ++i)
+        putchar(0);
+}
+
+// Round aOffset up to the next section boundary.
+//
+uint32_t align(uint32_t aOffset) {
+    return (aOffset + GFI_ALIGN - 1) / GFI_ALIGN * GFI_ALIGN;
+}
+
+// Parse the command line options.
+//
+void parse_options(int aArgc, char **aArgv) {
+    int     ch;
+    while ((ch = getopt(aArgc, aArgv, "cV")) != -1) {
+        switch (ch) {
+        case 'c':
+            gHeader = 1;
+            break;
+        case 'V':
+            printf("%s version %s\n", aArgv[0], VERSION);
+            exit (EXIT_SUCCESS);
+            break;
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+}
+
+// Output usage message and exit with status.
+//
+void usage(int aStatus) {
+    fprintf(stderr, "usage: hextogfi [options]\n");
+    fprintf(stderr, "Options [default]:\n");
+    fprintf(stderr, "  -c             write a C header of const tables instead\n");
+    fprintf(stderr, "  -V             output version/hash and exit\n");
+    fprintf(stderr, "\nReads hex font from stdin and writes gallant font image to stdout\n");
+    exit(aStatus);
+}
+
+// Print formatted message on stderr and exit.
+//
+void errx(const char *aFormat, ...) {
+    va_list ap;
+    va_start(ap, aFormat);
+    vfprintf(stderr, aFormat, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+/* vim: set tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
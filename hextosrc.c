@@ -10,10 +10,8 @@
  *     To adapt: modify PixelWidth and PixelHeight macros.
  */
 #include <stdio.h>
-#include <stdbool.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <string.h>
 #include <inttypes.h>
 #include <locale.h>
 #include <wchar.h>
@@ -22,115 +20,80 @@
 /* FreeBSD: devel/libunistring */
 #include <uniname.h>
 
+#include "cellwidth.h"
+#include "libgallant.h"
+
 #ifndef VERSION
 #define VERSION "(undefined)"
 #endif
 
 #define PixelWidth 12
 #define PixelHeight 22
-#define MAX_LINE 1024
-#define MAX_GLYPHS 131072
 #define FULL_BLOCK 0x2588
 
-struct glyph {
-    wint_t  codepoint;
-    char   *bitmap;
-};
-
 void    parse_options(int aArgc, char **aArgv);
 void    usage(int aStatus);
 void    errx(const char *aFormat, ...);
-void    parse_font_dimensions(FILE *aFile);
-void    parse_font_line(const char *aLine, struct glyph *aGlyph);
-void    output_src_char(int aChar);
-void   *xmalloc(size_t aSize);
-uint8_t hex_value(char aXdigit);
+void    check_font(void);
+void    output_src_char(unsigned int aGlyph);
 
 size_t  gWidth = PixelWidth;
 size_t  gHeight = PixelHeight;
-size_t  gLineNr = 0;
-size_t  gBytes = 0;            // per one row of pixels in a regular glyph
-size_t  gDblBytes = 0;         // per one row of pixels in a dbl width glyph
-struct glyph *gGlyph = NULL;
+struct font *gFont = NULL;
 
 // start the ball rolling.
 //
 int main(int aArgc, char **aArgv) {
     if (!setlocale(LC_CTYPE, ""))
         errx("Can't set the locale. Check LANG, LC_CTYPE, LC_ALL.\n");
-    int     gGlyphs = 0;
-    gGlyph = xmalloc(MAX_GLYPHS * sizeof *gGlyph);
     parse_options(aArgc, aArgv);
-    parse_font_dimensions(stdin);
-    char    buf[MAX_LINE];
-    while (fgets(buf, MAX_LINE, stdin)) {
-        ++gLineNr;
-        parse_font_line(buf, &gGlyph[gGlyphs]);
-        ++gGlyphs;
-    }
-    fprintf(stderr, "found %d glyphs\n", gGlyphs);
-    for (int i = 0; i < gGlyphs; ++i) {
+    char    error[FONT_ERROR_SIZE];
+    gFont = font_read_hex(stdin, "stdin", error);
+    if (gFont == NULL)
+        errx("%s\n", error);
+    if (error[0] != '\0')
+        fprintf(stderr, "%s\n", error);
+    check_font();
+    fprintf(stderr, "found %u glyphs\n", gFont->glyphs);
+    for (unsigned int i = 0; i < gFont->glyphs; ++i) {
         output_src_char(i);
     }
+    font_close(gFont);
     return EXIT_SUCCESS;
 }
 
 // Output data for a single STARTCHAR to stdout.
 //
-void output_src_char(int aChar) {
+void output_src_char(unsigned int aGlyph) {
+    const uint32_t codepoint = gFont->codepoint[aGlyph];
     char    name[UNINAME_MAX + 1];
-    const char *const u = unicode_character_name((ucs4_t) gGlyph[aChar].codepoint, name);
-    printf("STARTCHAR U%04x %s\n", gGlyph[aChar].codepoint, u ? u : "<no name>");
+    const char *const u = unicode_character_name((ucs4_t) codepoint, name);
+    printf("STARTCHAR U%04" PRIx32 " %s\n", codepoint, u ? u : "<no name>");
 
-    const bool is_double = wcwidth(gGlyph[aChar].codepoint) == 2;
-    const size_t pixels = is_double ? 2 * gWidth : gWidth;
-    const char *p = gGlyph[aChar].bitmap;
+    const size_t pixels = gFont->cells[aGlyph] * gWidth;
+    const uint8_t *p = font_bitmap(gFont, aGlyph);
     for (size_t h = gHeight; h > 0; --h) {
         printf("%02zu |", h);
-        for (size_t i = 0; i < pixels; ++i) {
-            uint8_t nybble = hex_value(p[i / 4]);
-            putwchar((nybble & (8u >> (i % 4))) ? FULL_BLOCK : L' ');
-        }
-        p += is_double ? 2 * gDblBytes : 2 * gBytes;
+        for (size_t i = 0; i < pixels; ++i)
+            putwchar((p[i / 8] & (0x80u >> (i % 8))) ? FULL_BLOCK : L' ');
+        p += font_row_bytes(gFont, aGlyph);
         puts("|");
     }
     puts("ENDCHAR");
 }
 
-// Compute value of aXdigit.
+// Check that the font has the gallant font's dimensions, and that its
+// glyphs are as wide as cell_width() says.
 //
-uint8_t hex_value(char aXdigit) {
-    uint8_t h = (uint8_t) aXdigit;
-    if ((h >= '0') && (h <= '9'))
-        return h - '0';
-    if ((h >= 'A') && (h <= 'F'))
-        return (h - 'A') + 10;
-    if ((h >= 'a') && (h <= 'f'))
-        return (h - 'a') + 10;
-    return 0xFFu;
-}
-
-// Parse one line of font hex data and store result in glyph.
-//
-void parse_font_line(const char *aLine, struct glyph *aGlyph) {
-    char    c;
-    if (sscanf(aLine, "%" SCNx32 "%c", &aGlyph->codepoint, &c) == 2 && c == ':') {
-        const char *colon = strchr(aLine, ':');
-        const size_t hexlen = strlen(colon + 1) - 1;    // Minus newline.
-
-        if (wcwidth(aGlyph->codepoint) == 2) {
-            if (hexlen != gHeight * gDblBytes * 2)
-                errx("line %d: expected %zu hexdigits for double width glyph, got %zu\n", gLineNr, gHeight * gDblBytes * 2, hexlen);
-        }
-        else {
-            if (hexlen != gHeight * gBytes * 2)
-                errx("line %d: expected %zu hexdigits for normal width glyph, got %zu\n", gLineNr, gHeight * gBytes * 2, hexlen);
-        }
-        aGlyph->bitmap = xmalloc(hexlen);
-        memcpy(aGlyph->bitmap, colon + 1, hexlen);
+void check_font(void) {
+    if (gFont->width != PixelWidth || gFont->height != PixelHeight)
+        errx("dimensions do not match gallant font's 12x22\n");
+    for (unsigned int i = 0; i < gFont->glyphs; ++i) {
+        const uint32_t codepoint = gFont->codepoint[i];
+        const unsigned int cells = cell_width(codepoint) == 2 ? 2 : 1;
+        if (gFont->cells[i] != cells)
+            errx("U+%04" PRIX32 ": expected %s width glyph\n", codepoint, cells == 2 ? "double" : "normal");
     }
-    else
-        errx("expected codepoint:hexdata in line %d\n", gLineNr);
 }
 
 // Parse the command line options.
@@ -159,26 +122,6 @@ void parse_options(int aArgc, char **aArgv) {
         errx("dimensions do not match gallant font's 12x22\n");
 }
 
-// Parse the font's Width: and Height: directives.
-//
-void parse_font_dimensions(FILE *aFile) {
-    char    line[MAX_LINE] = { 0 };
-    for (int i = 1; i <= 2; ++i) {
-        if (fgets(line, sizeof line, aFile) != NULL) {
-            if (sscanf(line, " # Width: %zu", &gWidth) != 1)
-                if (sscanf(line, " # Height: %zu", &gHeight) != 1)
-                    errx("line %d must be '# Width or Height: number'\n", i);
-        }
-        else
-            errx("could not read line %d\n", i);
-    }
-    if (gWidth != PixelWidth || gHeight != PixelHeight)
-        errx("dimensions do not match gallant font's 12x22\n");
-    gBytes = (gWidth + 7) / 8;
-    gDblBytes = (2 * gWidth + 7) / 8;
-}
-
-
 // Output usage message and exit with status.
 //
 void usage(int aStatus) {
@@ -190,15 +133,6 @@ void usage(int aStatus) {
     exit(aStatus);
 }
 
-// Allocate memory and exit on failure.
-//
-void   *xmalloc(size_t aSize) {
-    void   *const mem = malloc(aSize);
-    if (mem == NULL)
-        errx("failed to allocate %zu bytes\n", aSize);
-    return mem;
-}
-
 // Print formatted message on stderr and exit.
 //
 void errx(const char *aFormat, ...) {
@@ -0,0 +1,752 @@
+/*
+ * libgallant.c - load raster fonts, look up and draw their glyphs
+ *
+ * Every loader ends up in the same store: the glyph arrays, and the
+ * bitmaps unless a font image or compiled in tables supply them, share one
+ * arena. Hex and src fonts are read in a single pass, into an arena sized
+ * from the file size or, from a pipe, grown by doubling. Only fonts out of
+ * order get sorted. The page table's pages share one more allocation.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cellwidth.h"
+#include "gfi.h"
+#include "hexdecode.h"
+#include "libgallant.h"
+
+#define FULL_BLOCK  "\xe2\x96\x88"     // U+2588 in UTF-8, a set pixel in src fonts.
+#define TABSTOP     8
+
+// A font being built: writable views of its arena and how full it is.
+struct loader {
+    struct font *font;
+    const char *name;
+    char   *error;
+    uint32_t *codepoint;
+    uint32_t *offset;
+    uint8_t *cells;
+    uint8_t *pool;                     // Bitmaps, unless supplied by the caller.
+    size_t  glyph_capacity;            // Not counting room for a replacement.
+    size_t  bitmap_capacity;           // Ditto.
+    size_t  bitmap_bytes;
+    unsigned int glyphs;
+    bool    sorted;
+};
+
+// A glyph's place in the arrays, for sorting them by codepoint.
+struct order {
+    uint32_t codepoint;
+    uint32_t glyph;
+};
+
+static bool fail(char *aError, const char *aFormat, ...);
+static struct font *font_new(unsigned int aWidth, unsigned int aHeight, const char *aName, char *aError);
+static bool loader_init(struct loader *aLoader, struct font *aFont, const char *aName, char *aError,
+                        FILE *aFile, size_t aBytesPerGlyph);
+static bool loader_reserve(struct loader *aLoader, size_t aGlyphs, size_t aBitmapBytes);
+static uint8_t *loader_add(struct loader *aLoader, uint32_t aCodepoint, unsigned int aCells);
+static struct font *loader_finish(struct loader *aLoader);
+static struct font *loader_abandon(struct loader *aLoader);
+static bool sort_glyphs(struct loader *aLoader);
+static bool build_pages(struct font *aFont, char *aError);
+static bool read_dimensions(FILE *aFile, const char *aName, unsigned int *aWidth, unsigned int *aHeight,
+                            char *aError);
+static bool parse_src_row(struct loader *aLoader, const char *aLine, unsigned int aLineNr, uint8_t *aRow,
+                          unsigned int aPixels);
+static struct font *adopt_tables(struct font *aFont, unsigned int aGlyphs, const uint32_t *aCodepoints,
+                                 const uint8_t *aCells, const uint32_t *aOffsets, const uint8_t *aBitmaps,
+                                 size_t aBitmapBytes, const char *aName, char *aError);
+static int compare_codepoints(const void *aFirst, const void *aSecond);
+static int compare_order(const void *aFirst, const void *aSecond);
+
+// Open aFilename as a font image, a hex font or, with the dimensions
+// FONT_SRC_WIDTH and FONT_SRC_HEIGHT, a src font, telling them apart by
+// their first byte. Only that byte is peeked at, so a hex or src font can
+// come from a pipe.
+//
+struct font *font_open(const char *aFilename, char *aError) {
+    FILE   *const fp = fopen(aFilename, "r");
+    if (fp == NULL) {
+        fail(aError, "can't open(%s): %s", aFilename, strerror(errno));
+        return NULL;
+    }
+    const int c = getc(fp);
+    struct font *font;
+    if (c == GFI_MAGIC[0]) {
+        fclose(fp);
+        return font_map_image(aFilename, aError);
+    }
+    ungetc(c, fp);
+    if (c == 'S')
+        font = font_read_src(fp, aFilename, FONT_SRC_WIDTH, FONT_SRC_HEIGHT, aError);
+    else
+        font = font_read_hex(fp, aFilename, aError);
+    fclose(fp);
+    return font;
+}
+
+// Read a font in hex format: '# Width: w' and '# Height: h' lines, then one
+// 'codepoint:hexdata' line per glyph. The length of the hex data tells
+// single from double width glyphs. Other lines starting with '#' are
+// comments. Lines that do not scan as codepoint:hexdata are skipped; a
+// font with any leaves a note of them in aError, which is empty otherwise.
+// aName is used in messages.
+//
+struct font *font_read_hex(FILE *aFile, const char *aName, char *aError) {
+    unsigned int width, height;
+    if (!read_dimensions(aFile, aName, &width, &height, aError))
+        return NULL;
+    struct font *const font = font_new(width, height, aName, aError);
+    if (font == NULL)
+        return NULL;
+    struct loader loader;
+    if (!loader_init(&loader, font, aName, aError, aFile, 2 * (size_t) height * font->bytes + 2))
+        return loader_abandon(&loader);
+
+    char   *line = NULL;
+    size_t  size = 0;
+    ssize_t len;
+    unsigned int line_no = 2;
+    unsigned int skipped = 0;
+    unsigned int first_skipped = 0;
+    while ((len = getline(&line, &size, aFile)) != -1) {
+        ++line_no;
+        if (line[0] == '#')
+            continue;
+        char    c;
+        uint32_t codepoint;
+        if (sscanf(line, "%" SCNx32 "%c", &codepoint, &c) != 2 || c != ':') {
+            if (skipped++ == 0)
+                first_skipped = line_no;
+            continue;
+        }
+        const char *const hex = strchr(line, ':') + 1;
+        const size_t digits = strcspn(hex, "\r\n");
+        unsigned int cells;
+        if (digits == 2 * (size_t) height * font->bytes)
+            cells = 1;
+        else if (digits == 2 * (size_t) height * font->dbl_bytes)
+            cells = 2;
+        else {
+            fail(aError, "unexpected length %zu of hex data in %s, line %u", digits, aName, line_no);
+            break;
+        }
+        uint8_t *const bitmap = loader_add(&loader, codepoint, cells);
+        if (bitmap == NULL)
+            break;
+        const size_t bad = hex_decode(bitmap, hex, digits);
+        if (bad != digits) {
+            fail(aError, "invalid hex digit '%c' in %s, line %u, column %zu", hex[bad], aName, line_no,
+                 (size_t) (hex - line) + bad + 1);
+            break;
+        }
+    }
+    const bool done = len == -1;
+    free(line);
+    if (!done)
+        return loader_abandon(&loader);
+    if (ferror(aFile)) {
+        fail(aError, "error reading %s", aName);
+        return loader_abandon(&loader);
+    }
+    if (loader_finish(&loader) == NULL)
+        return NULL;
+    if (skipped == 0)
+        aError[0] = '\0';
+    else
+        snprintf(aError, FONT_ERROR_SIZE, "skipped %u line(s) in %s that do not scan, the first is line %u",
+                 skipped, aName, first_skipped);
+    return font;
+}
+
+// Read a font in src format, aWidth by aHeight pixels per cell: per glyph a
+// 'STARTCHAR Uxxxx' line, aHeight rows of pixels between '|' delimiters,
+// SPACE for clear and FULL BLOCK for set, and an 'ENDCHAR' line. Whether a
+// glyph is double width comes from cell_width(). aName is used in messages.
+//
+struct font *font_read_src(FILE *aFile, const char *aName, unsigned int aWidth, unsigned int aHeight, char *aError) {
+    struct font *const font = font_new(aWidth, aHeight, aName, aError);
+    if (font == NULL)
+        return NULL;
+    struct loader loader;
+    if (!loader_init(&loader, font, aName, aError, aFile, (size_t) aHeight * (aWidth + 6)))
+        return loader_abandon(&loader);
+
+    char   *line = NULL;
+    size_t  size = 0;
+    unsigned int line_no = 0;
+    unsigned int rows = 0;             // Pixel rows of the current glyph read so far.
+    unsigned int cells = 1;
+    uint32_t codepoint = 0;
+    uint8_t *bitmap = NULL;            // Of the current glyph, NULL between glyphs.
+    bool    ok = true;
+    while (ok && getline(&line, &size, aFile) != -1) {
+        ++line_no;
+        if (bitmap == NULL) {
+            if (sscanf(line, "STARTCHAR U%" SCNx32, &codepoint) != 1)
+                ok = fail(aError, "expected 'STARTCHAR Uxxxx' in %s, line %u", aName, line_no);
+            else {
+                cells = cell_width(codepoint) == 2 ? 2 : 1;
+                bitmap = loader_add(&loader, codepoint, cells);
+                ok = bitmap != NULL;
+                rows = 0;
+            }
+        }
+        else if (rows < aHeight) {
+            ok = parse_src_row(&loader, line, line_no, bitmap, cells * aWidth);
+            bitmap += cells == 1 ? font->bytes : font->dbl_bytes;
+            ++rows;
+        }
+        else if (strcmp(line, "ENDCHAR\n") != 0)
+            ok = fail(aError, "expected 'ENDCHAR' for U+%04" PRIX32 " in %s, line %u", codepoint, aName, line_no);
+        else
+            bitmap = NULL;
+    }
+    free(line);
+    if (ok && bitmap != NULL)
+        ok = fail(aError, "incomplete glyph U+%04" PRIX32 " at the end of %s", codepoint, aName);
+    if (ok && ferror(aFile))
+        ok = fail(aError, "error reading %s", aName);
+    return ok ? loader_finish(&loader) : loader_abandon(&loader);
+}
+
+// Set the pixels of one src row, aPixels wide, in the zeroed aRow.
+//
+static bool parse_src_row(struct loader *aLoader, const char *aLine, unsigned int aLineNr, uint8_t *aRow,
+                          unsigned int aPixels) {
+    const char *p = strchr(aLine, '|');
+    if (p == NULL)
+        return fail(aLoader->error, "initial delimiter '|' not found in %s, line %u", aLoader->name, aLineNr);
+    unsigned int x = 0;
+    for (++p; *p != '|'; ++x) {
+        if (x == aPixels)
+            return fail(aLoader->error, "more than %u pixels between delimiters in %s, line %u", aPixels,
+                        aLoader->name, aLineNr);
+        if (*p == ' ')
+            ++p;
+        else if (strncmp(p, FULL_BLOCK, sizeof FULL_BLOCK - 1) == 0) {
+            aRow[x / 8] |= (uint8_t) (0x80u >> x % 8);
+            p += sizeof FULL_BLOCK - 1;
+        }
+        else if (*p == '\n' || *p == '\0')
+            return fail(aLoader->error, "final delimiter '|' not found in %s, line %u", aLoader->name, aLineNr);
+        else
+            return fail(aLoader->error, "pixels must be SPACE or FULL BLOCK in %s, line %u", aLoader->name, aLineNr);
+    }
+    if (x != aPixels)
+        return fail(aLoader->error, "expected %u pixels between delimiters, found %u in %s, line %u", aPixels, x,
+                    aLoader->name, aLineNr);
+    return true;
+}
+
+// Map a font image created by hextogfi and use its tables. The mapping is
+// dropped again if the bitmaps had to be copied.
+//
+struct font *font_map_image(const char *aFilename, char *aError) {
+    const int fd = open(aFilename, O_RDONLY);
+    if (fd == -1) {
+        fail(aError, "can't open(%s): %s", aFilename, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fail(aError, "can't stat %s: %s", aFilename, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    const size_t size = (size_t) st.st_size;
+    if (size < sizeof (struct gfi_header)) {
+        fail(aError, "%s: truncated font image", aFilename);
+        close(fd);
+        return NULL;
+    }
+    void   *const map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fail(aError, "can't mmap %s: %s", aFilename, strerror(errno));
+        return NULL;
+    }
+
+    const uint8_t *const image = map;
+    const struct gfi_header *const header = map;
+    bool    ok = false;
+    if (memcmp(header->magic, GFI_MAGIC, GFI_MAGIC_SIZE) != 0)
+        fail(aError, "%s: not a font image", aFilename);
+    else if (header->byte_order != GFI_BYTE_ORDER)
+        fail(aError, "%s: font image has foreign byte order, recreate it with hextogfi", aFilename);
+    else if (header->version != GFI_VERSION)
+        fail(aError, "%s: font image version %u, expected %u", aFilename, header->version, GFI_VERSION);
+    else if (header->size != size)
+        fail(aError, "%s: font image size %u, but file has %zu bytes", aFilename, header->size, size);
+    else if (header->codepoints % sizeof (uint32_t) != 0 || header->offsets % sizeof (uint32_t) != 0
+             || (uint64_t) header->codepoints + (uint64_t) header->glyphs * sizeof (uint32_t) > size
+             || (uint64_t) header->cells + header->glyphs > size
+             || (uint64_t) header->offsets + (uint64_t) header->glyphs * sizeof (uint32_t) > size
+             || header->bitmaps > size)
+        fail(aError, "%s: font image sections out of bounds", aFilename);
+    else
+        ok = true;
+    struct font *font = ok ? font_new(header->width, header->height, aFilename, aError) : NULL;
+    if (font != NULL)
+        font = adopt_tables(font, header->glyphs, (const void *) (image + header->codepoints),
+                            image + header->cells, (const void *) (image + header->offsets),
+                            image + header->bitmaps, size - header->bitmaps, aFilename, aError);
+    if (font != NULL && font->bitmaps == image + header->bitmaps) {
+        font->map = map;
+        font->map_size = size;
+    }
+    else
+        munmap(map, size);
+    return font;
+}
+
+// Use sorted glyph tables laid out like the sections of a font image, such
+// as those hextogfi -c compiles in. They must stay valid while the font is.
+//
+struct font *font_from_tables(unsigned int aWidth, unsigned int aHeight, unsigned int aGlyphs,
+                              const uint32_t *aCodepoints, const uint8_t *aCells, const uint32_t *aOffsets,
+                              const uint8_t *aBitmaps, size_t aBitmapBytes, const char *aName, char *aError) {
+    struct font *const font = font_new(aWidth, aHeight, aName, aError);
+    if (font == NULL)
+        return NULL;
+    return adopt_tables(font, aGlyphs, aCodepoints, aCells, aOffsets, aBitmaps, aBitmapBytes, aName, aError);
+}
+
+// Check the tables and copy the glyph arrays into aFont's arena. The
+// bitmaps are used in place, unless the font has no U+FFFD: then they are
+// copied too, so the replacement can join them.
+//
+static struct font *adopt_tables(struct font *aFont, unsigned int aGlyphs, const uint32_t *aCodepoints,
+                                 const uint8_t *aCells, const uint32_t *aOffsets, const uint8_t *aBitmaps,
+                                 size_t aBitmapBytes, const char *aName, char *aError) {
+    bool    ok = true;
+    for (unsigned int i = 0; ok && i < aGlyphs; ++i) {
+        const size_t bytes = aFont->height * (size_t) (aCells[i] == 1 ? aFont->bytes : aFont->dbl_bytes);
+        if (aCells[i] != 1 && aCells[i] != 2)
+            ok = fail(aError, "%s: glyph %u has %u cells", aName, i, aCells[i]);
+        else if (i > 0 && aCodepoints[i] <= aCodepoints[i - 1])
+            ok = fail(aError, "%s: codepoints not sorted at glyph %u", aName, i);
+        else if (aOffsets[i] > aBitmapBytes || aBitmapBytes - aOffsets[i] < bytes)
+            ok = fail(aError, "%s: bitmap of glyph %u out of bounds", aName, i);
+    }
+    if (!ok) {
+        font_close(aFont);
+        return NULL;
+    }
+    const uint32_t replacement = 0xfffd;
+    const bool copy = bsearch(&replacement, aCodepoints, aGlyphs, sizeof *aCodepoints, compare_codepoints) == NULL;
+    struct loader loader;
+    if (!loader_init(&loader, aFont, aName, aError, NULL, 0)
+        || !loader_reserve(&loader, aGlyphs, copy ? aBitmapBytes : 0))
+        return loader_abandon(&loader);
+    memcpy(loader.codepoint, aCodepoints, aGlyphs * sizeof *loader.codepoint);
+    memcpy(loader.offset, aOffsets, aGlyphs * sizeof *loader.offset);
+    memcpy(loader.cells, aCells, aGlyphs);
+    loader.glyphs = aGlyphs;
+    if (copy) {
+        memcpy(loader.pool, aBitmaps, aBitmapBytes);
+        loader.bitmap_bytes = aBitmapBytes;
+    }
+    else
+        aFont->bitmaps = aBitmaps;
+    return loader_finish(&loader);
+}
+
+// Release aFont and all memory it owns.
+//
+void font_close(struct font *aFont) {
+    if (aFont == NULL)
+        return;
+    if (aFont->map != NULL)
+        munmap(aFont->map, aFont->map_size);
+    free(aFont->page_block);
+    free(aFont->arena);
+    free(aFont);
+}
+
+// Binary search the font's codepoints for aCodepoint. Return its glyph, or
+// aFont->glyphs if not found.
+//
+unsigned int font_find(const struct font *aFont, uint32_t aCodepoint) {
+    const uint32_t *const found = bsearch(&aCodepoint, aFont->codepoint, aFont->glyphs, sizeof *aFont->codepoint,
+                                          compare_codepoints);
+    return found == NULL ? aFont->glyphs : (unsigned int) (found - aFont->codepoint);
+}
+
+// Draw aGlyph with its top left pixel at aX, aY into a 1 bit per pixel
+// buffer of aStride bytes per scan line, most significant bit leftmost, by
+// setting its pixels. The buffer must hold the whole glyph.
+//
+void font_draw_glyph(const struct font *aFont, unsigned int aGlyph, uint8_t *aBuffer, size_t aStride,
+                     unsigned int aX, unsigned int aY) {
+    const uint8_t *bitmap = font_bitmap(aFont, aGlyph);
+    const unsigned int pixels = aFont->width * aFont->cells[aGlyph];
+    const unsigned int bytes = font_row_bytes(aFont, aGlyph);
+    const unsigned int shift = aX % 8;
+    const uint8_t last = (uint8_t) (0xFF << (8 * bytes - pixels));
+    for (unsigned int i = 0; i < aFont->height; ++i) {
+        uint8_t *const line = aBuffer + (aY + i) * aStride + aX / 8;
+        for (unsigned int b = 0; b < bytes; ++b) {
+            const unsigned int in = b == bytes - 1 ? bitmap[b] & last : bitmap[b];
+            line[b] |= (uint8_t) (in >> shift);
+            // Only pixels of the glyph spill into the next byte.
+            if (((in << (8 - shift)) & 0xFF) != 0)
+                line[b + 1] |= (uint8_t) (in << (8 - shift));
+        }
+        bitmap += bytes;
+    }
+}
+
+// Draw aLength bytes of UTF-8 text into a buffer as for font_draw_glyph(),
+// aColumns cells wide and aRows text rows high. Control characters, combining
+// and double width characters are handled like txttopng does, with tab
+// stops every 8 columns; what does not fit is clipped. Return how many rows
+// the text has. With a NULL aBuffer, nothing is drawn.
+//
+unsigned int font_render(const struct font *aFont, const char *aText, size_t aLength, uint8_t *aBuffer,
+                         size_t aStride, unsigned int aColumns, unsigned int aRows) {
+    const uint8_t *p = (const uint8_t *) aText;
+    const uint8_t *const end = p + aLength;
+    unsigned int row = 0, col = 0;
+    while (p < end) {
+        const uint32_t c = utf8_decode(&p, end);
+        const int width = cell_width(c);
+        unsigned int at = col;
+        if (width < 0) {
+            if (c == '\t')
+                col = (col / TABSTOP + 1) * TABSTOP;
+            else if (c == '\n') {
+                ++row;
+                col = 0;
+            }
+            else if (c == '\v' || c == '\f')
+                ++row;
+            else if (c == '\r')
+                col = 0;
+            continue;
+        }
+        if (width == 0)
+            at = col > 0 ? col - 1 : 0;
+        else
+            col += (unsigned int) width;
+        if (aBuffer == NULL || row >= aRows)
+            continue;
+        const unsigned int glyph = font_lookup(aFont, c);
+        if (at + aFont->cells[glyph] <= aColumns)
+            font_draw_glyph(aFont, glyph, aBuffer, aStride, at * aFont->width, row * aFont->height);
+    }
+    return col > 0 ? row + 1 : row;
+}
+
+// Decode the UTF-8 sequence at *aPos, which must be before aEnd, and advance
+// *aPos past it. A malformed sequence decodes as U+FFFD and consumes one
+// byte. Overlong forms, surrogates and values beyond U+10FFFF are malformed.
+//
+uint32_t utf8_decode(const uint8_t **aPos, const uint8_t *aEnd) {
+    const uint8_t *p = *aPos;
+    const uint32_t lead = *p;
+    uint32_t codepoint;
+    unsigned int trail;
+    uint8_t lo = 0x80, hi = 0xBF;   // Valid range of the first trail byte.
+
+    if (lead < 0x80) {
+        *aPos = p + 1;
+        return lead;
+    }
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        codepoint = lead & 0x1F;
+        trail = 1;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF) {
+        codepoint = lead & 0x0F;
+        trail = 2;
+        if (lead == 0xE0)
+            lo = 0xA0;
+        else if (lead == 0xED)
+            hi = 0x9F;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4) {
+        codepoint = lead & 0x07;
+        trail = 3;
+        if (lead == 0xF0)
+            lo = 0x90;
+        else if (lead == 0xF4)
+            hi = 0x8F;
+    }
+    else {
+        *aPos = p + 1;
+        return 0xFFFD;
+    }
+    if ((size_t) (aEnd - p) <= trail || p[1] < lo || p[1] > hi) {
+        *aPos = p + 1;
+        return 0xFFFD;
+    }
+    for (unsigned int i = 1; i <= trail; ++i) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *aPos = p + 1;
+            return 0xFFFD;
+        }
+        codepoint = (codepoint << 6) | (p[i] & 0x3F);
+    }
+    *aPos = p + trail + 1;
+    return codepoint;
+}
+
+// Store a formatted message in aError and return false.
+//
+static bool fail(char *aError, const char *aFormat, ...) {
+    va_list ap;
+    va_start(ap, aFormat);
+    vsnprintf(aError, FONT_ERROR_SIZE, aFormat, ap);
+    va_end(ap);
+    return false;
+}
+
+// Allocate an empty font of the given dimensions.
+//
+static struct font *font_new(unsigned int aWidth, unsigned int aHeight, const char *aName, char *aError) {
+    if (aWidth == 0 || aHeight == 0 || aWidth > 256 || aHeight > 256) {
+        fail(aError, "unsupported font dimensions %ux%u in %s", aWidth, aHeight, aName);
+        return NULL;
+    }
+    struct font *const font = calloc(1, sizeof *font);
+    if (font == NULL) {
+        fail(aError, "out of memory loading %s", aName);
+        return NULL;
+    }
+    font->width = aWidth;
+    font->height = aHeight;
+    font->bytes = (aWidth + 7) / 8;
+    font->dbl_bytes = (2 * aWidth + 7) / 8;
+    return font;
+}
+
+// Start loading aFont. Reading aFile, the arena is sized from the file
+// size: every glyph takes at least aBytesPerGlyph bytes of it and every
+// bitmap byte at least two. Other files start small and grow.
+//
+static bool loader_init(struct loader *aLoader, struct font *aFont, const char *aName, char *aError,
+                        FILE *aFile, size_t aBytesPerGlyph) {
+    memset(aLoader, 0, sizeof *aLoader);
+    aLoader->font = aFont;
+    aLoader->name = aName;
+    aLoader->error = aError;
+    aLoader->sorted = true;
+    if (aFile == NULL)
+        return true;
+    size_t  glyphs = 1024;
+    size_t  bytes = glyphs * aFont->height * aFont->bytes;
+    struct stat st;
+    if (fstat(fileno(aFile), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        glyphs = (size_t) st.st_size / aBytesPerGlyph + 1;
+        bytes = (size_t) st.st_size / 2;
+        if (bytes > glyphs * aFont->height * aFont->dbl_bytes)
+            bytes = glyphs * aFont->height * aFont->dbl_bytes;
+    }
+    return loader_reserve(aLoader, glyphs, bytes);
+}
+
+// Move the glyphs loaded so far to a new arena with room for aGlyphs glyphs
+// and aBitmapBytes of bitmaps, each plus a replacement: the codepoint,
+// offset and cells arrays, followed by the bitmaps.
+//
+static bool loader_reserve(struct loader *aLoader, size_t aGlyphs, size_t aBitmapBytes) {
+    struct font *const font = aLoader->font;
+    const size_t glyphs = aGlyphs + 1;
+    const size_t bitmaps = aBitmapBytes + font->height * (size_t) font->bytes;
+    if (aGlyphs >= UINT32_MAX || bitmaps > UINT32_MAX)
+        return fail(aLoader->error, "too much glyph data in %s", aLoader->name);
+    uint32_t *const words = malloc(2 * glyphs * sizeof *words + glyphs + bitmaps);
+    if (words == NULL)
+        return fail(aLoader->error, "out of memory loading %s", aLoader->name);
+    uint8_t *const cells = (uint8_t *) (words + 2 * glyphs);
+    uint8_t *const pool = cells + glyphs;
+    if (font->arena != NULL) {
+        memcpy(words, aLoader->codepoint, aLoader->glyphs * sizeof *words);
+        memcpy(words + glyphs, aLoader->offset, aLoader->glyphs * sizeof *words);
+        memcpy(cells, aLoader->cells, aLoader->glyphs);
+        memcpy(pool, aLoader->pool, aLoader->bitmap_bytes);
+        free(font->arena);
+    }
+    font->arena = words;
+    aLoader->codepoint = words;
+    aLoader->offset = words + glyphs;
+    aLoader->cells = cells;
+    aLoader->pool = pool;
+    aLoader->glyph_capacity = aGlyphs;
+    aLoader->bitmap_capacity = aBitmapBytes;
+    return true;
+}
+
+// Append a glyph, growing the arena as needed. Return its zeroed bitmap
+// to fill in, or NULL if out of memory.
+//
+static uint8_t *loader_add(struct loader *aLoader, uint32_t aCodepoint, unsigned int aCells) {
+    const struct font *const font = aLoader->font;
+    const size_t bytes = font->height * (size_t) (aCells == 1 ? font->bytes : font->dbl_bytes);
+    if (aLoader->glyphs == aLoader->glyph_capacity || aLoader->bitmap_capacity - aLoader->bitmap_bytes < bytes)
+        if (!loader_reserve(aLoader, 2 * aLoader->glyph_capacity, 2 * aLoader->bitmap_capacity + bytes))
+            return NULL;
+    const unsigned int i = aLoader->glyphs++;
+    if (i > 0 && aCodepoint < aLoader->codepoint[i - 1])
+        aLoader->sorted = false;
+    aLoader->codepoint[i] = aCodepoint;
+    aLoader->cells[i] = (uint8_t) aCells;
+    aLoader->offset[i] = (uint32_t) aLoader->bitmap_bytes;
+    uint8_t *const bitmap = aLoader->pool + aLoader->bitmap_bytes;
+    memset(bitmap, 0, bytes);
+    aLoader->bitmap_bytes += bytes;
+    return bitmap;
+}
+
+// Complete the font: sort it if needed, check the codepoints, append a
+// replacement if it has none, and build the page table.
+//
+static struct font *loader_finish(struct loader *aLoader) {
+    struct font *const font = aLoader->font;
+    uint32_t *const codepoint = aLoader->codepoint;
+    const unsigned int glyphs = aLoader->glyphs;
+    if (glyphs == 0) {
+        fail(aLoader->error, "no glyphs in %s", aLoader->name);
+        return loader_abandon(aLoader);
+    }
+    if (!aLoader->sorted && !sort_glyphs(aLoader))
+        return loader_abandon(aLoader);
+    for (unsigned int i = 0; i < glyphs; ++i) {
+        if (codepoint[i] >= FONT_MAX_CODEPOINT) {
+            fail(aLoader->error, "glyph U+%04" PRIX32 " beyond U+10FFFF in %s", codepoint[i], aLoader->name);
+            return loader_abandon(aLoader);
+        }
+        if (i > 0 && codepoint[i] == codepoint[i - 1]) {
+            fail(aLoader->error, "glyph U+%04" PRIX32 " multiply defined in %s", codepoint[i], aLoader->name);
+            return loader_abandon(aLoader);
+        }
+    }
+    font->glyphs = glyphs;
+    font->codepoint = codepoint;
+    font->offset = aLoader->offset;
+    font->cells = aLoader->cells;
+    if (font->bitmaps == NULL)
+        font->bitmaps = aLoader->pool;
+    font->replacement = font_find(font, 0xfffd);
+    if (font->replacement == glyphs) {
+        // A 50% shade made of vertical 1 pixel bars works for any size font.
+        uint8_t *const bitmap = aLoader->pool + aLoader->bitmap_bytes;
+        memset(bitmap, 0xaa, font->height * (size_t) font->bytes);
+        codepoint[glyphs] = 0xfffd;
+        aLoader->offset[glyphs] = (uint32_t) (bitmap - font->bitmaps);
+        aLoader->cells[glyphs] = 1;
+    }
+    if (!build_pages(font, aLoader->error))
+        return loader_abandon(aLoader);
+    return font;
+}
+
+// Give up loading: release the font and return NULL.
+//
+static struct font *loader_abandon(struct loader *aLoader) {
+    font_close(aLoader->font);
+    return NULL;
+}
+
+// Sort the glyph arrays by codepoint.
+//
+static bool sort_glyphs(struct loader *aLoader) {
+    const unsigned int glyphs = aLoader->glyphs;
+    struct order *const order = malloc(glyphs * sizeof *order);
+    uint32_t *const offset = malloc(glyphs * sizeof *offset);
+    uint8_t *const cells = malloc(glyphs);
+    const bool ok = order != NULL && offset != NULL && cells != NULL;
+    if (ok) {
+        for (unsigned int i = 0; i < glyphs; ++i) {
+            order[i].codepoint = aLoader->codepoint[i];
+            order[i].glyph = i;
+        }
+        qsort(order, glyphs, sizeof *order, compare_order);
+        memcpy(offset, aLoader->offset, glyphs * sizeof *offset);
+        memcpy(cells, aLoader->cells, glyphs);
+        for (unsigned int i = 0; i < glyphs; ++i) {
+            aLoader->codepoint[i] = order[i].codepoint;
+            aLoader->offset[i] = offset[order[i].glyph];
+            aLoader->cells[i] = cells[order[i].glyph];
+        }
+    }
+    free(cells);
+    free(offset);
+    free(order);
+    return ok || fail(aLoader->error, "out of memory sorting %s", aLoader->name);
+}
+
+// Fill the page table from the sorted codepoints. Only ranges of
+// FONT_SLOTS codepoints that contain a glyph get a page of their own, all
+// in one allocation.
+//
+static bool build_pages(struct font *aFont, char *aError) {
+    size_t  used = 0;
+    for (unsigned int i = 0; i < aFont->glyphs; ++i)
+        if (i == 0 || aFont->codepoint[i] >> FONT_SLOT_BITS != aFont->codepoint[i - 1] >> FONT_SLOT_BITS)
+            ++used;
+    aFont->page_block = malloc(used * FONT_SLOTS * sizeof *aFont->page_block);
+    if (aFont->page_block == NULL)
+        return fail(aError, "out of memory building page table");
+    for (unsigned int s = 0; s < FONT_SLOTS; ++s)
+        aFont->empty_page[s] = aFont->replacement;
+    for (unsigned int p = 0; p < FONT_PAGES; ++p)
+        aFont->pages[p] = aFont->empty_page;
+    uint32_t *page = aFont->page_block - FONT_SLOTS;
+    for (unsigned int i = 0; i < aFont->glyphs; ++i) {
+        const uint32_t codepoint = aFont->codepoint[i];
+        if (aFont->pages[codepoint >> FONT_SLOT_BITS] == aFont->empty_page) {
+            page += FONT_SLOTS;
+            memcpy(page, aFont->empty_page, sizeof aFont->empty_page);
+            aFont->pages[codepoint >> FONT_SLOT_BITS] = page;
+        }
+        page[codepoint & (FONT_SLOTS - 1)] = i;
+    }
+    return true;
+}
+
+// Parse the font's Width: and Height: directives.
+//
+static bool read_dimensions(FILE *aFile, const char *aName, unsigned int *aWidth, unsigned int *aHeight,
+                            char *aError) {
+    char    line[256];
+    *aWidth = *aHeight = 0;
+    for (int i = 1; i <= 2; ++i) {
+        if (fgets(line, sizeof line, aFile) == NULL)
+            return fail(aError, "could not read line %d in %s", i, aName);
+        if (sscanf(line, " # Width: %u", aWidth) != 1)
+            if (sscanf(line, " # Height: %u", aHeight) != 1)
+                return fail(aError, "line %d in %s must be '# Width or Height: number'", i, aName);
+    }
+    return true;
+}
+
+// Compare callback for bsearch of codepoints.
+//
+static int compare_codepoints(const void *aFirst, const void *aSecond) {
+    const uint32_t *first = aFirst, *second = aSecond;
+    return (*first > *second) - (*first < *second);
+}
+
+// Compare callback for qsort of glyphs by codepoint.
+//
+static int compare_order(const void *aFirst, const void *aSecond) {
+    const struct order *first = aFirst, *second = aSecond;
+    if (first->codepoint != second->codepoint)
+        return (first->codepoint > second->codepoint) - (first->codepoint < second->codepoint);
+    return (first->glyph > second->glyph) - (first->glyph < second->glyph);
+}
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
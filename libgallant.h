@@ -0,0 +1,94 @@
+/*
+ * libgallant.h - load raster fonts, look up and draw their glyphs
+ *
+ * The font core of the tools, built as libgallant.a. A font loads from
+ * hex format, src format, a font image (gfi.h) or tables compiled in, into
+ * a struct font that is never modified afterwards, so any number of
+ * threads can share it. Nothing here prints or exits: functions that can
+ * fail return NULL and leave a message in the caller's aError buffer of
+ * FONT_ERROR_SIZE bytes. A hex font with lines that do not scan as
+ * codepoint:hexdata still loads without them; font_read_hex() then leaves
+ * a warning in aError, and an empty string otherwise.
+ */
+#ifndef LIBGALLANT_H
+#define LIBGALLANT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define FONT_ERROR_SIZE     256
+#define FONT_MAX_CODEPOINT  0x110000
+#define FONT_SLOT_BITS      8
+#define FONT_SLOTS          (1u << FONT_SLOT_BITS)
+#define FONT_PAGES          (FONT_MAX_CODEPOINT >> FONT_SLOT_BITS)
+
+/* Src files do not record their dimensions; font_open() assumes these. */
+#define FONT_SRC_WIDTH      12
+#define FONT_SRC_HEIGHT     22
+
+// A loaded font. Glyphs are parallel arrays indexed by glyph number, to
+// iterate over: codepoint[] sorted ascending, cells[] 1 or 2, and offset[]
+// of the glyph's bitmap in bitmaps, height rows of (cells * width + 7) / 8
+// bytes, most significant bit leftmost. If the font has no U+FFFD, one is
+// appended as glyph number glyphs, past the sorted range. pages[] maps
+// every codepoint to its glyph, or to replacement if it has none.
+struct font {
+    unsigned int width;                // Pixels per cell.
+    unsigned int height;               // Pixel rows per glyph.
+    unsigned int bytes;                // per one row of pixels in a regular glyph
+    unsigned int dbl_bytes;            // per one row of pixels in a dbl width glyph
+    unsigned int glyphs;
+    unsigned int replacement;          // Glyph drawn for missing codepoints.
+    const uint32_t *codepoint;
+    const uint8_t *cells;
+    const uint32_t *offset;
+    const uint8_t *bitmaps;
+    const uint32_t *pages[FONT_PAGES];
+    uint32_t empty_page[FONT_SLOTS];
+    void   *arena;                     // Owns codepoint[], cells[], offset[], maybe bitmaps.
+    uint32_t *page_block;              // Owns the pages other than empty_page.
+    void   *map;                       // Mapped font image, if any, and its size.
+    size_t  map_size;
+};
+
+struct font *font_open(const char *aFilename, char *aError);
+struct font *font_read_hex(FILE *aFile, const char *aName, char *aError);
+struct font *font_read_src(FILE *aFile, const char *aName, unsigned int aWidth, unsigned int aHeight, char *aError);
+struct font *font_map_image(const char *aFilename, char *aError);
+struct font *font_from_tables(unsigned int aWidth, unsigned int aHeight, unsigned int aGlyphs,
+                              const uint32_t *aCodepoints, const uint8_t *aCells, const uint32_t *aOffsets,
+                              const uint8_t *aBitmaps, size_t aBitmapBytes, const char *aName, char *aError);
+void    font_close(struct font *aFont);
+unsigned int font_find(const struct font *aFont, uint32_t aCodepoint);
+void    font_draw_glyph(const struct font *aFont, unsigned int aGlyph, uint8_t *aBuffer, size_t aStride,
+                        unsigned int aX, unsigned int aY);
+unsigned int font_render(const struct font *aFont, const char *aText, size_t aLength, uint8_t *aBuffer,
+                         size_t aStride, unsigned int aColumns, unsigned int aRows);
+uint32_t utf8_decode(const uint8_t **aPos, const uint8_t *aEnd);
+
+// Return the glyph of aCodepoint, or the replacement if the font has none.
+// Two loads through the page table.
+//
+static inline unsigned int font_lookup(const struct font *aFont, uint32_t aCodepoint) {
+    if (aCodepoint >= FONT_MAX_CODEPOINT)
+        return aFont->replacement;
+    return aFont->pages[aCodepoint >> FONT_SLOT_BITS][aCodepoint & (FONT_SLOTS - 1)];
+}
+
+// Return the bitmap of aGlyph.
+//
+static inline const uint8_t *font_bitmap(const struct font *aFont, unsigned int aGlyph) {
+    return aFont->bitmaps + aFont->offset[aGlyph];
+}
+
+// Return the bytes per pixel row of aGlyph.
+//
+static inline unsigned int font_row_bytes(const struct font *aFont, unsigned int aGlyph) {
+    return aFont->cells[aGlyph] == 1 ? aFont->bytes : aFont->dbl_bytes;
+}
+
+#endif
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
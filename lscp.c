@@ -28,7 +28,7 @@
  *
  * COMPILATION
  *    FreeBSD:
- *    cc -o lscp -I /usr/local/include -L /usr/local/lib -luninameslist -lunistring lscp.c
+ *    cc -o lscp -I /usr/local/include -L /usr/local/lib -luninameslist -lunistring lscp.c cellwidth.c
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,6 +43,8 @@
 /* FreeBSD: devel/libunistring */
 #include <uniname.h>
 
+#include "cellwidth.h"
+
 int main(int aArgc, char **aArgv) {
     if (!setlocale(LC_CTYPE, "")) {
         fprintf(stderr, "Can't set the locale. Check LANG, LC_CTYPE, LC_ALL.\n");
@@ -65,7 +67,7 @@ int main(int aArgc, char **aArgv) {
     for (unsigned long i = start; i < end; ++i) {
         char    name[UNINAME_MAX + 1];
         const char *const p = unicode_character_name((ucs4_t)i, name);
-        printf("U+%04lx %2d a %lc b %s\n", i, wcwidth((wchar_t)i), (wint_t)i, p ? p : "<no name>");
+        printf("U+%04lx %2d a %lc b %s\n", i, cell_width((uint32_t) i), (wint_t)i, p ? p : "<no name>");
     }
     return EXIT_SUCCESS;
 }
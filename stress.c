@@ -0,0 +1,124 @@
+/*
+ * NAME
+ *     stress - render one text on many threads sharing a glyphset
+ *
+ * EXAMPLE USAGE
+ *     stress 8 -f gallant.hex -t UTF-8-demo.txt -p stress.png
+ *     stress 4 -f gallant.gfi -t UTF-8-demo.txt -p stress.png -s -j 2
+ *
+ * DESCRIPTION
+ *     Compiles txttopng in and checks that its render() is safe to call
+ *     concurrently. The first argument is the number of threads, the rest
+ *     are txttopng options naming one job. Every thread renders the job
+ *     with the same glyphset, still without any shifted glyphs so the
+ *     threads race to build them, into the PNG file named by -p with the
+ *     thread number appended. Then the job is rendered once more on a
+ *     glyphset of its own to the -p file itself, and each thread's image
+ *     must be identical to that one. Matching copies are removed. The exit
+ *     status is nonzero if any of them differs.
+ */
+#define main txttopng_main
+int     main(int aArgc, char **aArgv);
+#include "txttopng.c"
+#undef main
+
+#define MAX_THREADS   256
+#define MAX_PATH      1024
+
+// A thread's render of the job.
+struct stress_job {
+    pthread_t thread;
+    struct options options;
+    struct glyphset *glyphset;
+    struct tally tally;
+    char    filename[MAX_PATH];
+};
+
+void   *stress_worker(void *aJob);
+uint8_t *read_file(const char *aFilename, size_t *aSize);
+
+// Start the ball rolling.
+//
+int main(int aArgc, char **aArgv) {
+    struct options options;
+    struct glyphset shared, reference;
+    struct tally total;
+
+    if (!setlocale(LC_CTYPE, ""))
+        errx("Can't set the locale. Check LANG, LC_CTYPE, LC_ALL.\n");
+    if (aArgc < 2)
+        errx("usage: stress threads [txttopng options]\n");
+    const unsigned int threads = (unsigned int) parse_number(aArgv[1], 1, MAX_THREADS);
+    parse_options(aArgc - 1, aArgv + 1, &options);
+    if (options.manifest_filename != NULL || options.complement_filename != NULL)
+        errx("stress renders a single image, without -m or -I\n");
+    if (strcmp(options.png_filename, "-") == 0)
+        errx("stress can't compare images on standard output\n");
+
+    struct stress_job *const jobs = xmalloc(threads * sizeof *jobs);
+    load_font(&shared, options.font_filename);
+    for (unsigned int i = 0; i < threads; ++i) {
+        struct stress_job *const job = &jobs[i];
+        job->options = options;
+        job->options.png_filename = job->filename;
+        job->glyphset = &shared;
+        memset(&job->tally, 0, sizeof job->tally);
+        snprintf(job->filename, sizeof job->filename, "%s.%u", options.png_filename, i + 1);
+        if (pthread_create(&job->thread, NULL, stress_worker, job) != 0)
+            errx("can't create thread %u\n", i);
+    }
+    for (unsigned int i = 0; i < threads; ++i)
+        pthread_join(jobs[i].thread, NULL);
+    unload_font(&shared);
+
+    memset(&total, 0, sizeof total);
+    load_font(&reference, options.font_filename);
+    render(&options, &reference, &total);
+    unload_font(&reference);
+    tally_free(&total);
+
+    size_t  expected_size;
+    uint8_t *const expected = read_file(options.png_filename, &expected_size);
+    unsigned int matches = 0;
+    for (unsigned int i = 0; i < threads; ++i) {
+        size_t  size;
+        uint8_t *const image = read_file(jobs[i].filename, &size);
+        if (size == expected_size && memcmp(image, expected, size) == 0) {
+            remove(jobs[i].filename);
+            ++matches;
+        }
+        else
+            fprintf(stderr, "%s differs from %s\n", jobs[i].filename, options.png_filename);
+        free(image);
+        tally_free(&jobs[i].tally);
+    }
+    free(expected);
+    free(jobs);
+    printf("%u of %u concurrent renders match %s\n", matches, threads, options.png_filename);
+    return matches == threads ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Render a stress_job's image.
+//
+void   *stress_worker(void *aJob) {
+    struct stress_job *const job = aJob;
+    render(&job->options, job->glyphset, &job->tally);
+    return NULL;
+}
+
+// Read all of aFilename into memory, and its size into aSize.
+//
+uint8_t *read_file(const char *aFilename, size_t *aSize) {
+    FILE   *const fp = xfopen(aFilename, "rb");
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1)
+        errx("can't stat %s: %s\n", aFilename, strerror(errno));
+    *aSize = (size_t) st.st_size;
+    uint8_t *const data = xmalloc(*aSize + 1);
+    if (fread(data, 1, *aSize, fp) != *aSize)
+        errx("can't read %s\n", aFilename);
+    fclose(fp);
+    return data;
+}
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
@@ -17,15 +17,28 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
-#include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <errno.h>
 #include <locale.h>
 #include <wchar.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 /* From libpng; on FreeBSD: /usr/ports/graphics/png. */
 #include <png.h>
+#include <zlib.h>
+
+#include "cellwidth.h"
+#include "libgallant.h"
+#ifdef BUILTIN_FONT
+/* Generated from gallant.hex by hextogfi -c, see GNUmakefile. */
+#include "gallant.h"
+#endif
 
 #ifndef HASH
 #define HASH "(undefined)"
@@ -36,118 +49,684 @@
 
 /* Default option values. */
 #define TextFilename  "input.txt"
+#ifdef BUILTIN_FONT
+#define FontFilename  "builtin"
+#else
 #define FontFilename  "jsgallant.hex"
+#endif
 #define PngFilename   "output.png"
 #define InvertedImage false
 #define Tabstop       8
 
-/* That's hopefully plenty. */
-#define MAX_GLYPHS    65536
+/* Frame buffer scan lines start on cache line boundaries. */
+#define CACHE_LINE    64
+
+/* Pre-shifted glyph rows are carved out of chunks of this size. */
+#define SHIFT_CHUNK   65536
+
+/* Text rows a worker thread draws at a time with -j. */
+#define BAND_ROWS     32
+
+/* Streaming unmaps the text behind it in steps of this many bytes. */
+#define RELEASE_BYTES (1 << 20)
 
-/* Longest line in font file we want to parse. */
+/* Longest line in a manifest we want to parse. */
 #define MAX_LINE      4096
 
-// Glyph properties.
-struct glyph {
-    wint_t  codepoint;
-    uint8_t *bitmap;
-    unsigned int cells;
+// A PNG file being written.
+struct png_sink {
+    const char *filename;
+    FILE   *file;
+    png_structp png;
+    png_infop info;
+    size_t  bytes;
+};
+
+// Phases timed by -v and -J.
+enum phase {
+    PHASE_LOAD_FONT,
+    PHASE_LOAD_TEXT,
+    PHASE_FB_ALLOC,
+    PHASE_FB_DRAW_TEXT,
+    PHASE_FB_SAVE_PNG,
+    PHASES
+};
+
+// How -v and -J report.
+enum stats {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+// Drawing counters for -v and -J.
+struct draw_stats {
+    size_t  lookups;                   // glyphs looked up and drawn
+    size_t  replacements;              // of those, drawn as the replacement
+    size_t  pixels;                    // pixels set by drawing glyphs
+};
+
+// A text row that later rows may repeat, keyed by a hash of its bytes.
+struct row_key {
+    uint64_t hash;
+    size_t  offset;
+    size_t  length;                    // 0 for an empty slot
+    unsigned int row;
+};
+
+// A codepoint missing from the font and how often the text used it (-u).
+struct miss {
+    uint32_t codepoint;
+    unsigned int count;
+};
+
+// Where a text row starts in the text, and how wide it is.
+struct line {
+    size_t  offset;
+    unsigned int column;               // at the start of the row
+    unsigned int width;                // columns reached by \r, \n, \v or \f
+};
+
+// The command line options. Each job of a manifest renders with a copy
+// naming its own files. Never changed while rendering.
+struct options {
+    const char *text_filename;
+    const char *font_filename;
+    const char *png_filename;
+    const char *complement_filename;   // -I
+    const char *manifest_filename;
+    bool    inverted;
+    bool    streaming;                 // -s
+    bool    locale_decoder;            // -L
+    bool    pixels;                    // -P
+    bool    miss_report;               // -u
+    unsigned int threads;              // -j
+    unsigned int tabstop;
+    // -r and -c. Their bounds count from 1, or from -1 at the end; 0
+    // leaves a bound open.
+    bool    row_range;
+    int     row_bounds[2];
+    bool    column_range;
+    int     column_bounds[2];
+    // PNG encoder settings; -1 keeps libpng's default.
+    int     png_level;
+    int     png_strategy;
+    int     png_filters;
+    int     png_window_bits;
+    int     png_mem_level;
+    enum stats stats;
+    FILE   *info;                      // stdout, unless a PNG goes there (-p - or -I -)
+};
+
+// Pre-shifted glyph rows are carved out of a list of these.
+struct shift_chunk {
+    struct shift_chunk *next;
+    uint8_t rows[];
 };
 
-void    parse_options(int aArgc, char **aArgv);
-void    load_font(void);
-void    parse_font_dimensions(FILE *aFile);
-void    parse_font_hexdata(FILE *aFile);
-void    parse_font_line(const char *aLine, int aLineNr, struct glyph *aGlyph);
-void    set_replacement_character(void);
-unsigned int count_glyphs(FILE *aFile);
-void    load_text(void);
-void    slurp_text(FILE *aFile);
-void    fb_alloc(unsigned int aHeight, unsigned int aWidth, unsigned int aRows, unsigned int aColumns, bool aInverted);
-void    fb_draw_pixel(unsigned int aXpos, unsigned int aYpos);
-void    fb_draw_glyph(wint_t aCodepoint, unsigned int aRow, unsigned int aColumn);
-void    fb_draw_text(void);
-void    fb_save_png(void);
-struct glyph *lookup_glyph(wint_t aCodepoint);
-int     compare_glyphs(const void *aFirst, const void *aSecond);
+// The loaded font, copies of its properties and its glyph rows shifted
+// right by each bit phase a glyph can start at, built on first use.
+// Columns start at multiples of width bits, so the phases are the
+// multiples of phase_step = gcd(width, 8). shifted[] has phases entries
+// per glyph, the replacement included; NULL until built. A missing entry
+// is built under lock and published atomically, so renders on any number
+// of threads can share one glyphset.
+struct glyphset {
+    struct font *font;
+    unsigned int glyphs;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bytes;                // per one row of pixels in a regular glyph
+    unsigned int dbl_bytes;            // per one row of pixels in a dbl width glyph
+    unsigned int replacement;
+    const uint8_t **shifted;
+    unsigned int phases;
+    unsigned int phase_step;
+    pthread_mutex_t lock;              // Guards building entries and the rest.
+    struct shift_chunk *chunks;
+    uint8_t *chunk_next;
+    size_t  chunk_free;
+    size_t  shifted_glyphs;
+    size_t  shifted_bytes;
+    size_t  bytes_allocated;
+};
+
+// Instrumentation (-v, -J): wall and CPU time per phase, and counters. With
+// -u, how often the text used each codepoint missing from the font, in
+// pages like the font's that are only allocated once a miss falls into
+// them. Each render keeps its own; main() sums them up over a manifest.
+struct tally {
+    double  phase_wall[PHASES];
+    double  phase_cpu[PHASES];
+    double  phase_start_wall;
+    clock_t phase_start_cpu;
+    struct draw_stats draw;
+    size_t  rows_copied;               // repeated rows copied, not drawn
+    size_t  decoded_bytes;             // text decoded while laying it out
+    double  decode_cpu;                // and the CPU time that took
+    size_t  bytes_allocated;
+    size_t  png_bytes;
+    unsigned int *misses[FONT_PAGES];
+};
+
+struct render;
+
+// Glyph renderer; -P selects the per-pixel reference implementation.
+typedef void draw_fn(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn);
+
+// Everything one render of a text to a PNG image needs, besides its options
+// and the shared glyphset. With -j, its worker threads share it: they only
+// write the scan lines of their own bands, and the band state under
+// band_lock.
+struct render {
+    const struct options *options;
+    struct glyphset *glyphset;
+    struct tally tally;
+
+    // With -c, draw_glyph clips and draw_inside draws the glyphs that need
+    // no clipping.
+    draw_fn *draw_glyph;
+    draw_fn *draw_inside;
+
+    // Array of frame buffer scan lines ("rows" in PNG parlance). They all
+    // point into one slab, stride bytes apart. The frame buffer holds
+    // fb_rows text rows; text row r is drawn at text row r % fb_rows. When
+    // streaming, it holds a single text row, or a ring of bands when
+    // drawing on several threads.
+    png_bytep *framebuffer;
+    uint8_t *slab;
+    size_t  stride;
+    size_t  slab_bytes;
+    unsigned int fb_rows;
+
+    // Threaded drawing (-j). Bands start at every BAND_ROWS-th drawn row of
+    // the line index. Workers claim bands in order and mark them ready; the
+    // PNG writer consumes them in order. When streaming, a worker waits
+    // until the band it needs the ring slot of has been written.
+    unsigned int bands;
+    unsigned int band_slots;
+    unsigned int band_next;
+    unsigned int bands_written;
+    bool   *band_ready;
+    pthread_mutex_t band_lock;
+    pthread_cond_t band_done;
+    pthread_cond_t band_free;
+
+    // PNG output. sink[0] receives the frame buffer as drawn. With -I,
+    // sink[1] receives its complement, built line by line in complement.
+    struct png_sink sink[2];
+    unsigned int sinks;
+    png_bytep complement;
+
+    // Input text storage and properties. The UTF-8 text is mapped into
+    // memory and decoded as it is drawn. Standard input ("-"), pipes and
+    // other files that can't be mapped are read into text_buffer instead.
+    // With -L, characters are instead read from text_file with the C
+    // library's locale dependent decoder. When streaming, each pass over
+    // the mapped text unmaps the first text_released bytes it is done with,
+    // and text_fd stays open to map it again for drawing.
+    void   *text_map;
+    size_t  text_released;
+    int     text_fd;
+    uint8_t *text_buffer;
+    const uint8_t *text;
+    size_t  text_bytes;
+    size_t  text_chars;
+    FILE   *text_file;
+
+    // Line index built by the layout pass. line[r] tells where text row r
+    // starts; line[text_rows] where the text after the last row starts.
+    // line_width is the widest column reached in the row being laid out.
+    // Streaming keeps memory constant: without -r, the index only holds
+    // every line_step = BAND_ROWS-th row for -j's bands, without widths,
+    // and no rows at all on one thread (line_step 0).
+    struct line *line;
+    size_t  line_capacity;
+    unsigned int line_step;
+    unsigned int text_rows;
+    unsigned int line_width;
+
+    // The window of the laid out text that is drawn: rows rows from
+    // first_row and columns columns from first_column. All of it, unless
+    // narrowed with -r and -c.
+    unsigned int rows;
+    unsigned int columns;
+    unsigned int first_row;
+    unsigned int first_column;
+
+    // Repeated rows. Only rows starting at column 0 and ending with a
+    // newline qualify. Without streaming, row_source[r] is an earlier drawn
+    // row that drawn row r repeats, or r. The source must still be in the
+    // frame buffer and drawn by the same thread: any earlier row normally,
+    // one in the same band with -j. row_table finds earlier rows by hash.
+    // When streaming, fb_stream_rows() compares each row with the previous
+    // one as it goes, in constant memory. With -v or -J, row_stats[r] is
+    // what drawn row r counted, so a copy of it counts the same.
+    unsigned int *row_source;
+    struct draw_stats *row_stats;
+    struct row_key *row_table;
+    size_t  row_table_size;
+    size_t  row_table_used;
+};
+
+void    parse_options(int aArgc, char **aArgv, struct options *aOptions);
+void    render(const struct options *aOptions, struct glyphset *aGlyphset, struct tally *aTotal);
+void    run_manifest(const struct options *aOptions, struct glyphset *aGlyphset, struct tally *aTotal);
+void    render_init(struct render *aRender, const struct options *aOptions, struct glyphset *aGlyphset);
+void    render_free(struct render *aRender);
+void   *render_malloc(struct render *aRender, size_t aSize);
+void   *render_realloc(struct render *aRender, void *aMem, size_t aSize);
+void    load_font(struct glyphset *aGlyphset, const char *aFilename);
+void    unload_font(struct glyphset *aGlyphset);
+void    load_text(struct render *aRender);
+void    map_text(struct render *aRender);
+void    remap_text(struct render *aRender);
+void    release_text(struct render *aRender, const uint8_t *aPos);
+void    read_text(struct render *aRender, int aFd);
+void    unload_text(struct render *aRender);
+size_t  layout_text(struct render *aRender);
+size_t  layout_text_locale(struct render *aRender);
+void    layout_char(struct render *aRender, wint_t aChar, unsigned int *aColumn);
+void    index_row(struct render *aRender, size_t aOffset, unsigned int aColumn);
+void    select_rows(struct render *aRender);
+void    select_columns(struct render *aRender);
+void    dedup_rows(struct render *aRender);
+void    dedup_row(struct render *aRender, unsigned int aRow, size_t aStart, size_t aEnd, unsigned int aColumn,
+                  bool aNewline);
+unsigned int dedup_lookup(struct render *aRender, unsigned int aRow, size_t aOffset, size_t aLength);
+wint_t  text_getwc(struct render *aRender, const uint8_t **aPos);
+void    fb_alloc(struct render *aRender, unsigned int aHeight, unsigned int aWidth, unsigned int aRows,
+                 unsigned int aColumns, bool aInverted);
+void    fb_free(struct render *aRender);
+png_bytep *fb_row_lines(const struct render *aRender, unsigned int aRow);
+void    fb_draw_pixel(const struct render *aRender, png_bytep aLine, unsigned int aXpos);
+void    fb_draw_glyph(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn);
+void    fb_draw_glyph_pixels(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn);
+void    fb_draw_glyph_clipped(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn);
+void    fb_draw_text(struct render *aRender);
+const uint8_t *fb_draw_rows(struct render *aRender, const uint8_t *aPos, unsigned int *aColumn, unsigned int aRow,
+                            unsigned int aEnd, struct draw_stats *aStats);
+void    fb_end_row(struct render *aRender, unsigned int aRow, struct draw_stats *aRowStats, struct draw_stats *aStats);
+unsigned int fb_copy_rows(struct render *aRender, const uint8_t **aPos, unsigned int aRow, unsigned int aEnd,
+                          struct draw_stats *aStats);
+const uint8_t *fb_stream_rows(struct render *aRender, const uint8_t *aPos, unsigned int *aColumn, unsigned int aRow,
+                              unsigned int aEnd, bool aWrite, struct draw_stats *aStats);
+bool    repeats_row(const struct render *aRender, const uint8_t *aStart, const uint8_t *aNext);
+void    fb_draw_bands(struct render *aRender);
+void   *fb_draw_worker(void *aRender);
+void    fb_write_bands(struct render *aRender);
+void    fb_write_band(struct render *aRender, bool aKeep);
+void    fb_save_png(struct render *aRender);
+void    fb_png_begin(struct render *aRender);
+void    fb_png_end(struct render *aRender);
+void    fb_png_write_row(struct render *aRender, png_bytep aLine);
+void    fb_png_write_data(png_structp aPng, png_bytep aData, size_t aLength);
+void    fb_png_flush(png_structp aPng);
+void    fb_png_error(png_structp aPng, png_const_charp aMessage);
+int     parse_png_strategy(const char *aName);
+int     parse_png_filters(char *aNames);
+int     parse_number(const char *aArg, int aMin, int aMax);
+void    parse_range(const char *aArg, int aBounds[2]);
+int     parse_bound(const char *aStart, const char *aEnd, const char *aArg);
+unsigned int resolve_range(const int aBounds[2], unsigned int aCount, unsigned int *aFirst);
+unsigned int lookup_glyph(const struct glyphset *aGlyphset, wint_t aCodepoint);
+void    shift_cache_init(struct glyphset *aGlyphset);
+const uint8_t *shifted_rows(struct glyphset *aGlyphset, unsigned int aGlyph, unsigned int aShift);
+const uint8_t *shift_glyph(struct glyphset *aGlyphset, unsigned int aGlyph, unsigned int aShift);
 FILE   *xfopen(const char *aFilename, const char *aMode);
 void   *xmalloc(size_t aSize);
+void   *xrealloc(void *aMem, size_t aSize);
+double  seconds(void);
+void    phase_begin(struct tally *aTally);
+void    phase_end(struct tally *aTally, enum phase aPhase);
+void    tally_add(struct tally *aTotal, struct tally *aTally);
+void    tally_free(struct tally *aTally);
+void    count_glyph(const struct glyphset *aGlyphset, wint_t aCodepoint, struct draw_stats *aStats);
+void    draw_stats_add(struct draw_stats *aTotal, const struct draw_stats *aStats);
+void    count_drawn(struct render *aRender, const struct draw_stats *aStats);
+void    count_missing(struct render *aRender, wint_t aCodepoint);
+void    report_missing(const struct options *aOptions, const struct tally *aTotal);
+int     compare_misses(const void *aFirst, const void *aSecond);
+void    report_stats(const struct options *aOptions, const struct glyphset *aGlyphset, const struct tally *aTotal);
 void    errx(const char *aFormat, ...);
-uint8_t hex_value(char aXdigit);
 void    usage(int aStatus);
 
-// Array of frame buffer scan lines ("rows" in PNG parlance).
-static png_bytep *gFramebuffer = NULL;
-
-// Rasterfont storage and properties.
-static struct glyph *gGlyphset;
-static unsigned int gGlyphs = 0;
-static unsigned int gWidth = 0;
-static unsigned int gHeight = 0;
-static unsigned int gBytes = 0; // per one row of pixels in a regular glyph
-static unsigned int gDblBytes = 0;  // per one row of pixels in a dbl width glyph
-static struct glyph *gReplacement = NULL;
-
-// Input text storage and properties.
-static wchar_t *gText = NULL;
-static size_t gTextChars = 0;
-static unsigned int gRows = 0;
-static unsigned int gColumns = 0;
-static unsigned int gTabstop = Tabstop;
-
-// Default options.
-static const char *gTextFilename = TextFilename;
-static const char *gFontFilename = FontFilename;
-static const char *gPngFilename = PngFilename;
-static bool gInverted = InvertedImage;
+static const char *const gPhaseName[PHASES] = {
+    "load_font", "load_text", "fb_alloc", "fb_draw_text", "fb_save_png"
+};
 
 // Start the ball rolling.
 //
 int main(int aArgc, char **aArgv) {
+    struct options options;
+    struct glyphset glyphset;
+    struct tally total;
+
     if (!setlocale(LC_CTYPE, ""))
         errx("Can't set the locale. Check LANG, LC_CTYPE, LC_ALL.\n");
-    parse_options(aArgc, aArgv);
-    load_text();
-    load_font();
-    fb_alloc(gHeight, gWidth, gRows, gColumns, gInverted);
-    fb_draw_text();
-    fb_save_png();
+    parse_options(aArgc, aArgv, &options);
+    memset(&total, 0, sizeof total);
+    phase_begin(&total);
+    load_font(&glyphset, options.font_filename);
+    phase_end(&total, PHASE_LOAD_FONT);
+    if (options.manifest_filename != NULL)
+        run_manifest(&options, &glyphset, &total);
+    else
+        render(&options, &glyphset, &total);
+    if (options.miss_report)
+        report_missing(&options, &total);
+    if (options.stats != STATS_OFF)
+        report_stats(&options, &glyphset, &total);
+    tally_free(&total);
+    unload_font(&glyphset);
     return EXIT_SUCCESS;
 }
 
+// Render aOptions->text_filename to aOptions->png_filename with the
+// glyphset, then release everything but the glyphset and add the times and
+// counters to aTotal.
+//
+// When streaming or drawing on threads, the image rows are encoded while
+// drawing and only creating and finishing the PNG count as fb_save_png.
+//
+void render(const struct options *aOptions, struct glyphset *aGlyphset, struct tally *aTotal) {
+    const bool incremental = aOptions->streaming || aOptions->threads > 1;
+    struct render *const context = xmalloc(sizeof *context);
+
+    render_init(context, aOptions, aGlyphset);
+    phase_begin(&context->tally);
+    load_text(context);
+    phase_end(&context->tally, PHASE_LOAD_TEXT);
+    phase_begin(&context->tally);
+    fb_alloc(context, aGlyphset->height, aGlyphset->width,
+             !aOptions->streaming ? context->rows : aOptions->threads > 1 ? 2 * aOptions->threads * BAND_ROWS : 1,
+             context->columns, aOptions->inverted);
+    phase_end(&context->tally, PHASE_FB_ALLOC);
+    if (incremental) {
+        phase_begin(&context->tally);
+        fb_png_begin(context);
+        phase_end(&context->tally, PHASE_FB_SAVE_PNG);
+    }
+    phase_begin(&context->tally);
+    fb_draw_text(context);
+    phase_end(&context->tally, PHASE_FB_DRAW_TEXT);
+    phase_begin(&context->tally);
+    if (incremental)
+        fb_png_end(context);
+    else
+        fb_save_png(context);
+    phase_end(&context->tally, PHASE_FB_SAVE_PNG);
+    fb_free(context);
+    unload_text(context);
+    tally_add(aTotal, &context->tally);
+    render_free(context);
+    free(context);
+}
+
+// Render every job in the manifest file. A job is a line holding the text
+// file, the PNG file, optionally "inverted" or "normal" and optionally a
+// PNG file for the complementary image, separated by tabs. Jobs without
+// the third field use the -i setting. Empty lines and lines starting with
+// '#' are ignored.
+//
+void run_manifest(const struct options *aOptions, struct glyphset *aGlyphset, struct tally *aTotal) {
+    const char *const manifest = aOptions->manifest_filename;
+    FILE   *const fp = xfopen(manifest, "r");
+    struct options job = *aOptions;
+    char    line[MAX_LINE];
+    int     line_no = 0;
+    unsigned int jobs = 0;
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        ++line_no;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        char   *const png = strchr(line, '\t');
+        if (png == NULL)
+            errx("%s, line %d: expected text file and png file separated by a tab\n", manifest, line_no);
+        *png = '\0';
+        char   *const mode = strchr(png + 1, '\t');
+        job.inverted = aOptions->inverted;
+        job.complement_filename = NULL;
+        if (mode != NULL) {
+            *mode = '\0';
+            char   *const complement = strchr(mode + 1, '\t');
+            if (complement != NULL) {
+                *complement = '\0';
+                job.complement_filename = complement + 1;
+            }
+            if (strcmp(mode + 1, "inverted") == 0)
+                job.inverted = true;
+            else if (strcmp(mode + 1, "normal") == 0)
+                job.inverted = false;
+            else
+                errx("%s, line %d: expected 'inverted' or 'normal', got '%s'\n", manifest, line_no, mode + 1);
+        }
+        if (strcmp(png + 1, "-") == 0 || (job.complement_filename != NULL && strcmp(job.complement_filename, "-") == 0))
+            errx("%s, line %d: can't write a PNG to standard output\n", manifest, line_no);
+        job.text_filename = line;
+        job.png_filename = png + 1;
+        render(&job, aGlyphset, aTotal);
+        ++jobs;
+    }
+    fclose(fp);
+    fprintf(aOptions->info, "rendered %u jobs from %s\n", jobs, manifest);
+}
+
 // Parse the command line options.
 //
-void parse_options(int aArgc, char **aArgv) {
+void parse_options(int aArgc, char **aArgv, struct options *aOptions) {
+    *aOptions = (struct options) {
+        .text_filename = TextFilename,
+        .font_filename = FontFilename,
+        .png_filename = PngFilename,
+        .inverted = InvertedImage,
+        .threads = 1,
+        .tabstop = Tabstop,
+        .png_level = -1,
+        .png_strategy = -1,
+        .png_filters = -1,
+        .png_window_bits = -1,
+        .png_mem_level = -1,
+        .stats = STATS_OFF,
+    };
     int     ch;
-    while ((ch = getopt(aArgc, aArgv, "f:hip:T:t:V")) != -1) {
+    while ((ch = getopt(aArgc, aArgv, "c:F:f:hI:iJj:LM:m:Pp:r:S:sT:t:uVvW:z:")) != -1) {
         switch (ch) {
         case 'V':
             printf("%s version %s, hash %s\n", aArgv[0], VERSION, HASH);
             exit (EXIT_SUCCESS);
             break;
+        case 'c':
+            parse_range(optarg, aOptions->column_bounds);
+            aOptions->column_range = true;
+            break;
+        case 'F':
+            aOptions->png_filters = parse_png_filters(optarg);
+            break;
         case 'f':
-            gFontFilename = optarg;
+            aOptions->font_filename = optarg;
             break;
         case 'h':
             usage(EXIT_SUCCESS);
             break;
+        case 'I':
+            aOptions->complement_filename = optarg;
+            break;
         case 'i':
-            gInverted = true;
+            aOptions->inverted = true;
+            break;
+        case 'J':
+            aOptions->stats = STATS_JSON;
+            break;
+        case 'j':
+            if (sscanf(optarg, "%u", &aOptions->threads) != 1 || aOptions->threads == 0)
+                errx("can't convert '%s' to number of threads\n", optarg);
+            break;
+        case 'L':
+            aOptions->locale_decoder = true;
+            break;
+        case 'M':
+            aOptions->png_mem_level = parse_number(optarg, 1, 9);
+            break;
+        case 'm':
+            aOptions->manifest_filename = optarg;
+            break;
+        case 'P':
+            aOptions->pixels = true;
             break;
         case 'p':
-            gPngFilename = optarg;
+            aOptions->png_filename = optarg;
+            break;
+        case 'r':
+            parse_range(optarg, aOptions->row_bounds);
+            aOptions->row_range = true;
+            break;
+        case 'S':
+            aOptions->png_strategy = parse_png_strategy(optarg);
+            break;
+        case 's':
+            aOptions->streaming = true;
             break;
         case 'T':
-            if (sscanf(optarg, "%u", &gTabstop) != 1)
+            if (sscanf(optarg, "%u", &aOptions->tabstop) != 1)
                 errx("can't convert '%s' to tabstop integer\n", optarg);
             break;
         case 't':
-            gTextFilename = optarg;
+            aOptions->text_filename = optarg;
+            break;
+        case 'u':
+            aOptions->miss_report = true;
+            break;
+        case 'v':
+            aOptions->stats = STATS_TEXT;
+            break;
+        case 'W':
+            aOptions->png_window_bits = parse_number(optarg, 8, 15);
+            break;
+        case 'z':
+            aOptions->png_level = parse_number(optarg, 0, 9);
             break;
         default:
             usage(EXIT_FAILURE);
         }
     }
+    if (aOptions->threads > 1 && aOptions->locale_decoder)
+        errx("-j needs the mmap decoder and can't be combined with -L\n");
+    if (aOptions->row_range && aOptions->locale_decoder)
+        errx("-r needs the mmap decoder and can't be combined with -L\n");
+    aOptions->info = stdout;
+    const char *const png = aOptions->png_filename;
+    const char *const complement = aOptions->complement_filename;
+    if (strcmp(png, "-") == 0 || (complement != NULL && strcmp(complement, "-") == 0)) {
+        if (complement != NULL && strcmp(png, complement) == 0)
+            errx("-p and -I can't both write to standard output\n");
+        if (aOptions->manifest_filename != NULL)
+            errx("-m writes the PNG files named in the manifest, not to standard output\n");
+        aOptions->info = stderr;
+    }
+}
+
+// Convert aArg to an integer from aMin to aMax, or exit.
+//
+int parse_number(const char *aArg, int aMin, int aMax) {
+    int     value;
+    char    c;
+    if (sscanf(aArg, "%d%c", &value, &c) != 1 || value < aMin || value > aMax)
+        errx("expected a number from %d to %d, got '%s'\n", aMin, aMax, aArg);
+    return value;
+}
+
+// Parse a "first:last" range of rows or columns into aBounds. Either bound
+// may be left out.
+//
+void parse_range(const char *aArg, int aBounds[2]) {
+    const char *const colon = strchr(aArg, ':');
+    if (colon == NULL)
+        errx("expected first:last, got '%s'\n", aArg);
+    aBounds[0] = colon != aArg ? parse_bound(aArg, colon, aArg) : 0;
+    aBounds[1] = colon[1] != '\0' ? parse_bound(colon + 1, colon + strlen(colon), aArg) : 0;
+}
+
+// Convert the bound from aStart to aEnd of range aArg to a nonzero int, or
+// exit.
+//
+int parse_bound(const char *aStart, const char *aEnd, const char *aArg) {
+    char   *end;
+    errno = 0;
+    const long value = strtol(aStart, &end, 10);
+    if (end == aStart || end != aEnd || value == 0)
+        errx("expected first:last numbered from 1, or from -1 at the end, got '%s'\n", aArg);
+    if (errno == ERANGE || value < INT_MIN || value > INT_MAX)
+        errx("expected first:last from %d to %d, got '%s'\n", INT_MIN, INT_MAX, aArg);
+    return (int) value;
+}
+
+// Apply aBounds to aCount rows or columns. Return how many it selects, from
+// *aFirst on, or 0 if none.
+//
+unsigned int resolve_range(const int aBounds[2], unsigned int aCount, unsigned int *aFirst) {
+    const long count = aCount;
+    long    first = aBounds[0] > 0 ? aBounds[0] - 1 : aBounds[0] < 0 ? count + aBounds[0] : 0;
+    long    last = aBounds[1] > 0 ? aBounds[1] - 1 : aBounds[1] < 0 ? count + aBounds[1] : count - 1;
+    if (first < 0)
+        first = 0;
+    if (last >= count)
+        last = count - 1;
+    if (first > last)
+        return 0;
+    *aFirst = (unsigned int) first;
+    return (unsigned int) (last - first + 1);
+}
+
+// Convert a zlib strategy name to its value, or exit.
+//
+int parse_png_strategy(const char *aName) {
+    static const struct {
+        const char *name;
+        int     strategy;
+    } strategies[] = {
+        { "default", Z_DEFAULT_STRATEGY },
+        { "filtered", Z_FILTERED },
+        { "huffman", Z_HUFFMAN_ONLY },
+        { "rle", Z_RLE },
+        { "fixed", Z_FIXED },
+    };
+    for (size_t i = 0; i < sizeof strategies / sizeof strategies[0]; ++i)
+        if (strcmp(aName, strategies[i].name) == 0)
+            return strategies[i].strategy;
+    errx("unknown zlib strategy '%s'\n", aName);
+    return 0;
+}
+
+// Convert a comma separated list of PNG filter names to a filter mask for
+// png_set_filter(), or exit.
+//
+int parse_png_filters(char *aNames) {
+    static const struct {
+        const char *name;
+        int     filter;
+    } filters[] = {
+        { "none", PNG_FILTER_NONE },
+        { "sub", PNG_FILTER_SUB },
+        { "up", PNG_FILTER_UP },
+        { "avg", PNG_FILTER_AVG },
+        { "paeth", PNG_FILTER_PAETH },
+        { "all", PNG_ALL_FILTERS },
+    };
+    int     mask = 0;
+    for (char *name = strtok(aNames, ","); name != NULL; name = strtok(NULL, ",")) {
+        size_t  i = 0;
+        while (i < sizeof filters / sizeof filters[0] && strcmp(name, filters[i].name) != 0)
+            ++i;
+        if (i == sizeof filters / sizeof filters[0])
+            errx("unknown PNG filter '%s'\n", name);
+        mask |= filters[i].filter;
+    }
+    if (mask == 0)
+        errx("no PNG filter given\n");
+    return mask;
 }
 
 // Output usage message and exit with status.
@@ -155,36 +734,152 @@ void parse_options(int aArgc, char **aArgv) {
 void usage(int aStatus) {
     fprintf(stderr, "usage: txttopng [options]\n");
     fprintf(stderr, "Options [default]:\n");
+    fprintf(stderr, "  -c first:last  draw only these text columns, counted like -r's rows\n");
+    fprintf(stderr, "  -F filters     PNG row filters: all or a comma separated list of\n");
+    fprintf(stderr, "                 none, sub, up, avg, paeth [libpng default]\n");
     fprintf(stderr, "  -h             show this help text\n");
+    fprintf(stderr, "  -I pngfile     also write the complementary image, inverted or not\n");
     fprintf(stderr, "  -i             inverts image to black on white [%s]\n", InvertedImage ? "true" : "false");
-    fprintf(stderr, "  -f fontfile    [%s]\n", FontFilename);
-    fprintf(stderr, "  -p pngfile     [%s]\n", PngFilename);
+#ifdef BUILTIN_FONT
+    fprintf(stderr, "  -f fontfile    hex font, font image or builtin [%s]\n", FontFilename);
+#else
+    fprintf(stderr, "  -f fontfile    hex font or font image [%s]\n", FontFilename);
+#endif
+    fprintf(stderr, "  -J             like -v, with the phase times and counters as JSON\n");
+    fprintf(stderr, "  -j threads     draw bands of text rows on this many threads [1]\n");
+    fprintf(stderr, "  -L             decode text with fgetwc() (slow, for comparison)\n");
+    fprintf(stderr, "  -M memlevel    zlib memory level 1-9 [libpng default]\n");
+    fprintf(stderr, "  -m manifest    render the jobs listed in manifest, loading the font once\n");
+    fprintf(stderr, "  -P             draw pixel by pixel (slow reference renderer)\n");
+    fprintf(stderr, "  -p pngfile     - for standard output [%s]\n", PngFilename);
+    fprintf(stderr, "  -r first:last  draw only these text rows; negative ones count from the\n");
+    fprintf(stderr, "                 end, a missing one means the first or last [1:]\n");
+    fprintf(stderr, "  -S strategy    zlib strategy: default, filtered, huffman, rle, fixed\n");
+    fprintf(stderr, "                 [libpng default]\n");
+    fprintf(stderr, "  -s             stream: render one text row at a time in constant memory\n");
     fprintf(stderr, "  -T tabstop     [%d]\n", Tabstop);
-    fprintf(stderr, "  -t textfile    [%s]\n", TextFilename);
+    fprintf(stderr, "  -t textfile    - for standard input [%s]\n", TextFilename);
+    fprintf(stderr, "  -u             report codepoints missing from the font, most used first\n");
+    fprintf(stderr, "  -v             report timings, phase times and counters\n");
+    fprintf(stderr, "  -W windowbits  zlib window size 8-15 [libpng default]\n");
+    fprintf(stderr, "  -z level       zlib compression level 0-9 [libpng default]\n");
     exit(aStatus);
 }
 
-// Print the gText[] array glyph by glyph to the frame buffer.
+// Set up an empty render of aOptions with aGlyphset.
+//
+void render_init(struct render *aRender, const struct options *aOptions, struct glyphset *aGlyphset) {
+    memset(aRender, 0, sizeof *aRender);
+    aRender->options = aOptions;
+    aRender->glyphset = aGlyphset;
+    aRender->text_fd = -1;
+    aRender->draw_glyph = aOptions->pixels ? fb_draw_glyph_pixels : fb_draw_glyph;
+    if (aOptions->column_range) {
+        aRender->draw_inside = aRender->draw_glyph;
+        aRender->draw_glyph = fb_draw_glyph_clipped;
+    }
+    pthread_mutex_init(&aRender->band_lock, NULL);
+    pthread_cond_init(&aRender->band_done, NULL);
+    pthread_cond_init(&aRender->band_free, NULL);
+}
+
+// Release what render_init() set up. The frame buffer and the text must
+// have been released already.
+//
+void render_free(struct render *aRender) {
+    tally_free(&aRender->tally);
+    pthread_cond_destroy(&aRender->band_free);
+    pthread_cond_destroy(&aRender->band_done);
+    pthread_mutex_destroy(&aRender->band_lock);
+}
+
+// Allocate memory for aRender, counting it, and exit on failure.
+//
+void   *render_malloc(struct render *aRender, size_t aSize) {
+    aRender->tally.bytes_allocated += aSize;
+    return xmalloc(aSize);
+}
+
+// Resize memory of aRender, counting it, and exit on failure.
+//
+void   *render_realloc(struct render *aRender, void *aMem, size_t aSize) {
+    aRender->tally.bytes_allocated += aSize;
+    return xrealloc(aMem, aSize);
+}
+
+// Print the text glyph by glyph to the frame buffer. Text after the last
+// row counted by load_text() is not drawn. When streaming, each completed
+// row is handed to the PNG writer as soon as the text moves past it.
+//
+void fb_draw_text(struct render *aRender) {
+    const struct options *const options = aRender->options;
+    const double start = seconds();
+    const uint8_t *pos = aRender->text;
+    const unsigned int rows = aRender->rows;
+    unsigned int column = 0;
+    struct draw_stats stats = { 0, 0, 0 };
+    if (aRender->line != NULL) {
+        pos += aRender->line[aRender->first_row / aRender->line_step].offset;
+        column = aRender->line[aRender->first_row / aRender->line_step].column;
+    }
+    if (options->threads > 1)
+        fb_draw_bands(aRender);
+    else {
+        if (options->streaming)
+            fb_stream_rows(aRender, pos, &column, 0, rows, true, &stats);
+        else
+            fb_draw_rows(aRender, pos, &column, 0, rows, &stats);
+        count_drawn(aRender, &stats);
+    }
+    if (options->stats != STATS_OFF) {
+        if (rows == aRender->text_rows)
+            fprintf(options->info, "drew %zu codepoints in %.3f s\n", aRender->text_chars, seconds() - start);
+        else
+            fprintf(options->info, "drew rows %u to %u in %.3f s\n", aRender->first_row + 1,
+                    aRender->first_row + rows, seconds() - start);
+    }
+}
+
+// Draw text rows aRow up to aEnd from text position aPos, where the column
+// is *aColumn, adding what the rows drawn and copied count to *aStats with
+// -v or -J. Return the position after the character that ended the last
+// row, leaving its column in *aColumn.
 //
-void fb_draw_text(void) {
-    unsigned int row = 0;
-    unsigned int col = 0;
-    for (size_t i = 0; i < gTextChars; ++i) {
-        switch (wcwidth(gText[i])) {
+const uint8_t *fb_draw_rows(struct render *aRender, const uint8_t *aPos, unsigned int *aColumn, unsigned int aRow,
+                            unsigned int aEnd, struct draw_stats *aStats) {
+    const struct options *const options = aRender->options;
+    draw_fn *const draw_glyph = aRender->draw_glyph;
+    const unsigned int tabstop = options->tabstop;
+    const bool counting = options->stats != STATS_OFF;
+    unsigned int row = fb_copy_rows(aRender, &aPos, aRow, aEnd, aStats);
+    unsigned int col = row != aRow ? 0 : *aColumn;
+    unsigned int next;
+    png_bytep *lines = row < aEnd ? fb_row_lines(aRender, row) : NULL;
+    struct draw_stats row_stats = { 0, 0, 0 };
+    wint_t  wc;
+    while (row < aEnd && (wc = text_getwc(aRender, &aPos)) != WEOF) {
+        const int width = cell_width((uint32_t) wc);
+        if (counting && width >= 0)
+            count_glyph(aRender->glyphset, wc, &row_stats);
+        switch (width) {
         case -1:
-            switch (gText[i]) {
+            switch (wc) {
             case L'\t':
-                col += gTabstop;
-                col -= (col % gTabstop);
+                col += tabstop;
+                col -= (col % tabstop);
                 break;
             case L'\n':
-                ++row;
+                fb_end_row(aRender, row, &row_stats, aStats);
+                row = fb_copy_rows(aRender, &aPos, row + 1, aEnd, aStats);
                 col = 0;
                 break;
             case L'\v':
             case L'\f':
                 /* Handle \v and \f like xterm: advance to next row. */
-                ++row;
+                fb_end_row(aRender, row, &row_stats, aStats);
+                if ((next = fb_copy_rows(aRender, &aPos, row + 1, aEnd, aStats)) != row + 1)
+                    col = 0;
+                row = next;
                 break;
             case L'\r':
                 col = 0;
@@ -192,318 +887,986 @@ void fb_draw_text(void) {
             default:
                 break;
             }
+            if (row < aEnd)
+                lines = fb_row_lines(aRender, row);
             break;
         case 0:
-            fb_draw_glyph(gText[i], row, col > 0 ? col - 1 : 0);
+            draw_glyph(aRender, wc, lines, col > 0 ? col - 1 : 0);
             break;
         case 1:
-            fb_draw_glyph(gText[i], row, col);
+            draw_glyph(aRender, wc, lines, col);
             ++col;
             break;
         case 2:
-            fb_draw_glyph(gText[i], row, col);
+            draw_glyph(aRender, wc, lines, col);
             col += 2;
             break;
         default:
             break;
         }
     }
+    draw_stats_add(aStats, &row_stats);
+    *aColumn = col;
+    return aPos;
 }
 
-// Load utf8 encoded text from file into gText[].
+// Add what drawn row aRow counted in *aRowStats to *aStats, keep it for
+// the rows copying aRow and start counting the next row.
 //
-void load_text(void) {
-    FILE   *const fp = xfopen(gTextFilename, "rb");
-    size_t  wchars = 0;
-    unsigned int column = 0;
+void fb_end_row(struct render *aRender, unsigned int aRow, struct draw_stats *aRowStats, struct draw_stats *aStats) {
+    if (aRender->row_stats != NULL)
+        aRender->row_stats[aRow] = *aRowStats;
+    draw_stats_add(aStats, aRowStats);
+    *aRowStats = (struct draw_stats) { 0, 0, 0 };
+}
 
-    gRows = 0;
-    gColumns = 0;
-    wint_t  wc;
-    while ((wc = fgetwc(fp)) != WEOF) {
-        ++wchars;
-        switch (wcwidth(wc)) {
-        case -1:
-            /* Control character. A few influence row and column. */
-            if (wc == L'\t') {
-                column += gTabstop;
-                column -= (column % gTabstop);
-            }
-            else if (wc == L'\n') {
-                ++gRows;
-                if (column > gColumns)
-                    gColumns = column;
-                column = 0;
-            }
-            else if (wc == L'\v' || wc == L'\f') {
-                /* Handle \v and \f like xterm: advance to next row. */
-                ++gRows;
-            }
-            else if (wc == L'\r') {
-                column = 0;
-            }
-            else
-                fprintf(stderr, "ignoring width=-1 character U+%04x in row %u\n", wc, gRows + 1);
-            break;
-        case 0:
-            /* Combining character, zero width space, ... */
-            break;
-        case 1:
-            /* Ordinary character. */
-            ++column;
-            break;
-        case 2:
-            /* Double width character. */
-            column += 2;
-            break;
-        default:
-            errx("unexpected wcwidth(U+%04x)=%d\n", (unsigned int) wc, wcwidth(wc));
-            break;
+// Copy the rows from aRow on that repeat an earlier row, up to aEnd, and
+// move *aPos past their text. Their sources' counts are added to *aStats.
+// Return the next row to draw.
+//
+unsigned int fb_copy_rows(struct render *aRender, const uint8_t **aPos, unsigned int aRow, unsigned int aEnd,
+                          struct draw_stats *aStats) {
+    const unsigned int *const source = aRender->row_source;
+    if (source == NULL)
+        return aRow;
+    while (aRow < aEnd && source[aRow] != aRow) {
+        png_bytep *const to = fb_row_lines(aRender, aRow);
+        png_bytep *const from = fb_row_lines(aRender, source[aRow]);
+        if (to != from)
+            memcpy(to[0], from[0], (size_t) aRender->glyphset->height * aRender->stride);
+        if (aRender->row_stats != NULL) {
+            aRender->row_stats[aRow] = aRender->row_stats[source[aRow]];
+            draw_stats_add(aStats, &aRender->row_stats[aRow]);
         }
+        const uint8_t *const newline = memchr(*aPos, '\n', (size_t) (aRender->text + aRender->text_bytes - *aPos));
+        *aPos = newline + 1;
+        ++aRow;
     }
-    gTextChars = wchars;
-    printf("found %zu codepoints in %s, %u rows, max %u colums\n", gTextChars, gTextFilename, gRows, gColumns);
-    slurp_text(fp);
-    fclose(fp);
+    return aRow;
 }
 
-// Read text into gTextChars[] array.
+// Draw text rows aRow up to aEnd one at a time from text position aPos,
+// where the column is *aColumn, like fb_draw_rows(). A row that repeats the
+// previous one is copied from it instead, and counts the same in *aStats.
+// When streaming on one thread (aWrite), each row goes to the PNG writer
+// once drawn, and the frame buffer is kept for a repeat. Return the
+// position after the last row.
 //
-void slurp_text(FILE *aFile) {
-    rewind(aFile);
-    gText = xmalloc(gTextChars * sizeof *gText);
-    for (size_t i = 0; i < gTextChars; ++i) {
-        const wint_t wc = fgetwc(aFile);
-        if (wc != WEOF)
-            gText[i] = (wchar_t) wc;
-        else
-            gText[i] = L'\ufffd';   // File got shorter than expected.
+const uint8_t *fb_stream_rows(struct render *aRender, const uint8_t *aPos, unsigned int *aColumn, unsigned int aRow,
+                              unsigned int aEnd, bool aWrite, struct draw_stats *aStats) {
+    const uint8_t *prev = NULL;         // Start of the row this one repeats.
+    struct draw_stats row_stats = { 0, 0, 0 };  // Of the last row drawn.
+    unsigned int copied = 0;
+    for (unsigned int row = aRow; row < aEnd; ++row) {
+        const uint8_t *const start = aPos;
+        const bool clean = *aColumn == 0;
+        if (prev != NULL) {
+            png_bytep *const to = fb_row_lines(aRender, row);
+            png_bytep *const from = fb_row_lines(aRender, row - 1);
+            if (to != from)
+                memcpy(to[0], from[0], (size_t) aRender->glyphset->height * aRender->stride);
+            aPos += start - prev;
+            ++copied;
+        }
+        else {
+            row_stats = (struct draw_stats) { 0, 0, 0 };
+            aPos = fb_draw_rows(aRender, aPos, aColumn, row, row + 1, &row_stats);
+        }
+        draw_stats_add(aStats, &row_stats);
+        prev = row + 1 < aEnd && clean && repeats_row(aRender, start, aPos) ? start : NULL;
+        if (aWrite) {
+            fb_write_band(aRender, prev != NULL);
+            release_text(aRender, start);
+        }
     }
+    pthread_mutex_lock(&aRender->band_lock);
+    aRender->tally.rows_copied += copied;
+    pthread_mutex_unlock(&aRender->band_lock);
+    return aPos;
 }
 
-// Save the frame buffer as a PNG image.
+// Return whether the text at aNext repeats the row from aStart up to aNext,
+// which ends with a newline.
 //
-void fb_save_png(void) {
-    FILE   *fp = xfopen(gPngFilename, "wb");
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        errx("png_create_write_struct failed\n");
-
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
-        errx("png_create_write_struct failed\n");
-
-    if (setjmp(png_jmpbuf(png_ptr)))
-        errx("fatal png error\n");
-
-    png_init_io(png_ptr, fp);
-    png_set_IHDR(png_ptr, info_ptr, gWidth * gColumns, gHeight * gRows, 1,
-                 PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_write_info(png_ptr, info_ptr);
-    png_write_image(png_ptr, gFramebuffer);
-    png_write_end(png_ptr, NULL);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
-    printf("wrote WxH = %ux%u image to %s\n", gWidth * gColumns, gHeight * gRows, gPngFilename);
+bool repeats_row(const struct render *aRender, const uint8_t *aStart, const uint8_t *aNext) {
+    const size_t length = (size_t) (aNext - aStart);
+    return aRender->text_file == NULL && length > 0 && aNext[-1] == '\n'
+        && (size_t) (aRender->text + aRender->text_bytes - aNext) >= length && memcmp(aStart, aNext, length) == 0;
 }
 
-// Allocate frame buffer to hold the pixels. White on black, unless inverted.
+// Draw the text on -j worker threads, BAND_ROWS text rows at a time, while
+// this thread writes the finished bands to the PNG image in order. Each
+// worker only writes the scan lines of the band it claimed.
+//
+void fb_draw_bands(struct render *aRender) {
+    const unsigned int threads = aRender->options->threads;
+    pthread_t *const workers = render_malloc(aRender, threads * sizeof *workers);
+
+    aRender->bands = (aRender->rows + BAND_ROWS - 1) / BAND_ROWS;
+    aRender->band_slots = aRender->options->streaming ? aRender->fb_rows / BAND_ROWS : aRender->bands;
+    aRender->band_next = 0;
+    aRender->bands_written = 0;
+    aRender->band_ready = render_malloc(aRender, aRender->bands + 1u);
+    memset(aRender->band_ready, 0, aRender->bands + 1u);
+    for (unsigned int i = 0; i < threads; ++i)
+        if (pthread_create(&workers[i], NULL, fb_draw_worker, aRender) != 0)
+            errx("can't create thread %u\n", i);
+    fb_write_bands(aRender);
+    for (unsigned int i = 0; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+    free(aRender->band_ready);
+    aRender->band_ready = NULL;
+    free(workers);
+}
+
+// Worker thread: claim the next band of render aRender, wait for its ring
+// slot if streaming, draw it and mark it ready, until all bands are claimed.
 //
-void fb_alloc(unsigned int aHeight, unsigned int aWidth, unsigned int aRows, unsigned int aColumns, bool aInverted) {
-    const unsigned int fb_lines = aHeight * aRows;
-    gFramebuffer = xmalloc(fb_lines * sizeof *gFramebuffer);
+void   *fb_draw_worker(void *aRender) {
+    struct render *const render = aRender;
+    pthread_mutex_lock(&render->band_lock);
+    while (render->band_next < render->bands) {
+        const unsigned int band = render->band_next++;
+        while (band - render->bands_written >= render->band_slots)
+            pthread_cond_wait(&render->band_free, &render->band_lock);
+        pthread_mutex_unlock(&render->band_lock);
 
-    const unsigned int fb_pixels_per_line = aWidth * aColumns;
-    const unsigned int fb_bytes_per_line = (fb_pixels_per_line + 7) / 8;
-    for (unsigned int line = 0; line < fb_lines; ++line) {
-        gFramebuffer[line] = xmalloc(fb_bytes_per_line);
-        memset(gFramebuffer[line], aInverted ? 0xFF : 0, fb_bytes_per_line);
+        const unsigned int first = band * BAND_ROWS;
+        const unsigned int end = render->rows - first < BAND_ROWS ? render->rows : first + BAND_ROWS;
+        const struct line *const line = &render->line[(render->first_row + first) / render->line_step];
+        unsigned int column = line->column;
+        struct draw_stats stats = { 0, 0, 0 };
+        if (render->options->streaming)
+            fb_stream_rows(render, render->text + line->offset, &column, first, end, false, &stats);
+        else
+            fb_draw_rows(render, render->text + line->offset, &column, first, end, &stats);
+        count_drawn(render, &stats);
+
+        pthread_mutex_lock(&render->band_lock);
+        render->band_ready[band] = true;
+        pthread_cond_broadcast(&render->band_done);
     }
+    pthread_mutex_unlock(&render->band_lock);
+    return NULL;
 }
 
-// Load font in hex format from gFontFilename.
+// Write the bands to the PNG image in order as the workers finish them.
+// When streaming, clear each band's slot and hand it back to the workers,
+// and release the text before the next band.
 //
-void load_font(void) {
-    FILE   *fp = xfopen(gFontFilename, "r");
+void fb_write_bands(struct render *aRender) {
+    const unsigned int height = aRender->glyphset->height;
+    for (unsigned int band = 0; band < aRender->bands; ++band) {
+        pthread_mutex_lock(&aRender->band_lock);
+        while (!aRender->band_ready[band])
+            pthread_cond_wait(&aRender->band_done, &aRender->band_lock);
+        pthread_mutex_unlock(&aRender->band_lock);
 
-    parse_font_dimensions(fp);
-    gGlyphs = count_glyphs(fp);
-    fprintf(stderr, "found %u glyphs, width %u, height %u in %s\n", gGlyphs, gWidth, gHeight, gFontFilename);
-    if (gGlyphs < 2)
-        errx("that's not a font, it would seem\n");
-    gGlyphset = xmalloc(gGlyphs * sizeof *gGlyphset);
-    rewind(fp);
-    parse_font_hexdata(fp);
-    fclose(fp);
+        const unsigned int first = band * BAND_ROWS;
+        const unsigned int end = aRender->rows - first < BAND_ROWS ? aRender->rows : first + BAND_ROWS;
+        for (unsigned int row = first; row < end; ++row) {
+            png_bytep *const lines = fb_row_lines(aRender, row);
+            for (unsigned int line = 0; line < height; ++line)
+                fb_png_write_row(aRender, lines[line]);
+        }
+        if (aRender->options->streaming) {
+            memset(fb_row_lines(aRender, first)[0], aRender->options->inverted ? 0xFF : 0,
+                   (size_t) (end - first) * height * aRender->stride);
+            if (end < aRender->rows)
+                release_text(aRender, aRender->text + aRender->line[(aRender->first_row + end) / aRender->line_step].offset);
+        }
+
+        pthread_mutex_lock(&aRender->band_lock);
+        ++aRender->bands_written;
+        pthread_cond_broadcast(&aRender->band_free);
+        pthread_mutex_unlock(&aRender->band_lock);
+    }
 }
 
-// Parse the font's Width: and Height: directives.
+// Return the scan lines of text row aRow.
 //
-void parse_font_dimensions(FILE *aFile) {
-    char    line[MAX_LINE];
-    for (int i = 1; i <= 2; ++i) {
-        if (fgets(line, sizeof line, aFile) != NULL) {
-            if (sscanf(line, " # Width: %u", &gWidth) != 1)
-                if (sscanf(line, " # Height: %u", &gHeight) != 1)
-                    errx("line %d in %s must be '# Width or Height: number'\n", i, gFontFilename);
+png_bytep *fb_row_lines(const struct render *aRender, unsigned int aRow) {
+    return aRender->framebuffer + (size_t) aRender->glyphset->height * (aRow % aRender->fb_rows);
+}
+
+// Load utf8 encoded text from the text file, computing rows and columns in
+// a single pass, then pick the rows to draw and find repeated ones.
+//
+void load_text(struct render *aRender) {
+    const struct options *const options = aRender->options;
+    const clock_t start = clock();
+    aRender->rows = 0;
+    aRender->columns = 0;
+    aRender->first_row = 0;
+    aRender->line_width = 0;
+    aRender->line_step = !options->streaming || options->row_range ? 1 : options->threads > 1 ? BAND_ROWS : 0;
+    aRender->text_chars = options->locale_decoder ? layout_text_locale(aRender) : layout_text(aRender);
+    aRender->text_rows = aRender->rows;
+    if (aRender->text_fd != -1)
+        remap_text(aRender);
+    aRender->tally.decoded_bytes = aRender->text_bytes;
+    aRender->tally.decode_cpu = (double) (clock() - start) / CLOCKS_PER_SEC;
+    fprintf(options->info, "found %zu codepoints in %s, %u rows, max %u columns\n", aRender->text_chars,
+            options->text_filename, aRender->rows, aRender->columns);
+    aRender->first_column = 0;
+    if (options->row_range)
+        select_rows(aRender);
+    if (options->column_range)
+        select_columns(aRender);
+    if (aRender->line != NULL && !options->streaming)
+        dedup_rows(aRender);
+}
+
+// Narrow the rows to draw to -r's range and the columns to the widest of
+// those rows.
+//
+void select_rows(struct render *aRender) {
+    const struct options *const options = aRender->options;
+    aRender->rows = resolve_range(options->row_bounds, aRender->text_rows, &aRender->first_row);
+    if (aRender->rows == 0)
+        // An open bound is 0, which %.0d prints as nothing.
+        errx("no rows to draw in range %.0d:%.0d of %s with %u rows\n", options->row_bounds[0],
+             options->row_bounds[1], options->text_filename, aRender->text_rows);
+    aRender->columns = 0;
+    for (unsigned int row = aRender->first_row; row < aRender->first_row + aRender->rows; ++row)
+        if (aRender->line[row].width > aRender->columns)
+            aRender->columns = aRender->line[row].width;
+    fprintf(options->info, "selected rows %u to %u, max %u columns\n", aRender->first_row + 1,
+            aRender->first_row + aRender->rows, aRender->columns);
+}
+
+// Narrow the columns to draw to -c's range.
+//
+void select_columns(struct render *aRender) {
+    const struct options *const options = aRender->options;
+    const unsigned int columns = aRender->columns;
+    aRender->columns = resolve_range(options->column_bounds, columns, &aRender->first_column);
+    if (aRender->columns == 0)
+        // An open bound is 0, which %.0d prints as nothing.
+        errx("no columns to draw in range %.0d:%.0d of %s with %u columns\n", options->column_bounds[0],
+             options->column_bounds[1], options->text_filename, columns);
+    fprintf(options->info, "selected columns %u to %u\n", aRender->first_column + 1,
+            aRender->first_column + aRender->columns);
+}
+
+// Map the text file into memory, or read it if it is not a regular file.
+// A text file name of "-" means standard input.
+//
+void map_text(struct render *aRender) {
+    const char *const filename = aRender->options->text_filename;
+    const bool std_in = strcmp(filename, "-") == 0;
+    const int fd = std_in ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd == -1)
+        errx("can't open(%s): %s\n", filename, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        errx("can't stat %s: %s\n", filename, strerror(errno));
+    aRender->text = NULL;
+    if (!S_ISREG(st.st_mode))
+        read_text(aRender, fd);
+    else {
+        aRender->text_bytes = (size_t) st.st_size;
+        if (aRender->text_bytes > 0) {
+            aRender->text_map = mmap(NULL, aRender->text_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (aRender->text_map == MAP_FAILED)
+                errx("can't mmap %s: %s\n", filename, strerror(errno));
+            aRender->text = aRender->text_map;
+            aRender->text_released = 0;
+            if (aRender->options->streaming) {
+                aRender->text_fd = fd;
+                return;
+            }
         }
-        else
-            errx("could not read line %d in %s\n", i, gFontFilename);
     }
-    if (gWidth == 0 || gHeight == 0)
-        errx("could not parse width or height at the start of %s\n", gFontFilename);
-    gBytes = (gWidth + 7) / 8;
-    gDblBytes = (2 * gWidth + 7) / 8;
+    if (!std_in)
+        close(fd);
 }
 
-// First pass: count glyphs.
+// Map the streamed text again for drawing, after the layout pass unmapped
+// what it read.
 //
-unsigned int count_glyphs(FILE *aFile) {
-    unsigned int glyphs = 0;
-    char    line[MAX_LINE];
-    int     line_no = 2;
-    while (fgets(line, sizeof line, aFile) != NULL) {
-        char    c;
-        ++line_no;
-        if (line[0] == '#')
-            continue;
-        if (sscanf(line, "%*" SCNx32 "%c", &c) == 1 && c == ':')
-            ++glyphs;
-        else
-            fprintf(stderr, "skipping line %d in %s, does not scan\n", line_no, gFontFilename);
-        if (glyphs > MAX_GLYPHS)
-            errx("too many glyphs (max %d) in %s\n", MAX_GLYPHS, gFontFilename);
+void remap_text(struct render *aRender) {
+    if (aRender->text_released < aRender->text_bytes)
+        munmap((uint8_t *) aRender->text_map + aRender->text_released, aRender->text_bytes - aRender->text_released);
+    aRender->text_map = mmap(NULL, aRender->text_bytes, PROT_READ, MAP_PRIVATE, aRender->text_fd, 0);
+    if (aRender->text_map == MAP_FAILED)
+        errx("can't mmap %s: %s\n", aRender->options->text_filename, strerror(errno));
+    aRender->text = aRender->text_map;
+    aRender->text_released = 0;
+}
+
+// When streaming, unmap the text before aPos in steps of RELEASE_BYTES, so
+// what has been read for good leaves the resident set.
+//
+void release_text(struct render *aRender, const uint8_t *aPos) {
+    if (aRender->text_fd == -1)
+        return;
+    const size_t done = (size_t) (aPos - aRender->text) / RELEASE_BYTES * RELEASE_BYTES;
+    if (done > aRender->text_released) {
+        munmap((uint8_t *) aRender->text_map + aRender->text_released, done - aRender->text_released);
+        aRender->text_released = done;
     }
-    return glyphs;
 }
 
-// Load and convert hex data to binary bitmap representation.
+// Read the text from aFd up to end of file into text_buffer, doubling it as
+// needed.
 //
-void parse_font_hexdata(FILE *aFile) {
-    unsigned int glyphs = 0;
-    int     line_no = 0;
-    char    line[MAX_LINE];
+void read_text(struct render *aRender, int aFd) {
+    size_t  capacity = 65536;
+    size_t  bytes = 0;
+    ssize_t n;
+    uint8_t *buffer = render_malloc(aRender, capacity);
+    for (;;) {
+        if (bytes == capacity) {
+            capacity *= 2;
+            buffer = render_realloc(aRender, buffer, capacity);
+        }
+        n = read(aFd, buffer + bytes, capacity - bytes);
+        if (n == 0)
+            break;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            errx("can't read %s: %s\n", aRender->options->text_filename, strerror(errno));
+        }
+        bytes += (size_t) n;
+    }
+    aRender->text_buffer = buffer;
+    aRender->text_bytes = bytes;
+    aRender->text = buffer;
+}
 
-    while (fgets(line, sizeof line, aFile) != NULL) {
-        ++line_no;
-        if (line[0] == '#')
-            continue;
-        parse_font_line(line, line_no, &gGlyphset[glyphs]);
-        ++glyphs;
+// Unmap, free or close the text and forget the line index and repeated
+// rows.
+//
+void unload_text(struct render *aRender) {
+    if (aRender->text_map != NULL && aRender->text_released < aRender->text_bytes)
+        munmap((uint8_t *) aRender->text_map + aRender->text_released, aRender->text_bytes - aRender->text_released);
+    if (aRender->text_fd != -1 && aRender->text_fd != STDIN_FILENO)
+        close(aRender->text_fd);
+    aRender->text_fd = -1;
+    if (aRender->text_file != NULL)
+        fclose(aRender->text_file);
+    free(aRender->text_buffer);
+    aRender->text = NULL;
+    aRender->text_map = NULL;
+    aRender->text_buffer = NULL;
+    aRender->text_file = NULL;
+    aRender->text_bytes = 0;
+    free(aRender->line);
+    aRender->line = NULL;
+    aRender->line_capacity = 0;
+    free(aRender->row_source);
+    aRender->row_source = NULL;
+    free(aRender->row_stats);
+    aRender->row_stats = NULL;
+    free(aRender->row_table);
+    aRender->row_table = NULL;
+    aRender->row_table_size = 0;
+    aRender->row_table_used = 0;
+}
+
+// Map the text and decode it once, laying out rows and columns as we go and
+// indexing where each row starts. Runs of printable ASCII are taken in
+// bulk, one column per byte. Return the number of codepoints.
+//
+size_t layout_text(struct render *aRender) {
+    const bool miss_report = aRender->options->miss_report;
+    size_t  chars = 0;
+    unsigned int column = 0;
+
+    map_text(aRender);
+    const uint8_t *const text = aRender->text;
+    const uint8_t *p = text;
+    const uint8_t *const end = text + aRender->text_bytes;
+    index_row(aRender, 0, 0);
+    while (p < end) {
+        if (*p >= 0x20 && *p < 0x7f) {
+            const uint8_t *const run = p;
+            do
+                ++p;
+            while (p < end && *p >= 0x20 && *p < 0x7f);
+            column += (unsigned int) (p - run);
+            chars += (size_t) (p - run);
+            if (miss_report)
+                for (const uint8_t *q = run; q < p; ++q)
+                    count_missing(aRender, *q);
+        }
+        else {
+            const unsigned int rows = aRender->rows;
+            const wint_t wc = (wint_t) utf8_decode(&p, end);
+            layout_char(aRender, wc, &column);
+            ++chars;
+            if (aRender->rows != rows) {
+                index_row(aRender, (size_t) (p - text), column);
+                release_text(aRender, p);
+            }
+        }
     }
-    if (gGlyphs != glyphs)
-        errx("glyph count changed unexpectedly (%zu != %zu)\n", gGlyphs, glyphs);
-    qsort(gGlyphset, gGlyphs, sizeof *gGlyphset, compare_glyphs);
-    set_replacement_character();
+    if (aRender->line_step == 1)
+        aRender->line[aRender->rows].width = aRender->line_width;
+    return chars;
 }
 
-// Assign a suitable replacement character. If none was in the font, use 50%
-// shade made of vertical 1 pixel bars. That works for any size font.
+// Close the index entry of text row rows - 1 and start the one of row rows
+// at aOffset and aColumn, if the index holds it.
 //
-void set_replacement_character(void) {
-    gReplacement = NULL;
-    gReplacement = lookup_glyph(0xfffd);
-    if (gReplacement != NULL)
+void index_row(struct render *aRender, size_t aOffset, unsigned int aColumn) {
+    const unsigned int step = aRender->line_step;
+    const unsigned int rows = aRender->rows;
+    if (step == 0 || rows % step != 0)
         return;
-    gReplacement = xmalloc(sizeof *gReplacement);
-    gReplacement->bitmap = xmalloc(gHeight * gBytes);
-    memset(gReplacement->bitmap, 0xaa, gHeight * gBytes);
-    gReplacement->codepoint = 0xfffd;
-    gReplacement->cells = 1;
+    const size_t entry = rows / step;
+    if (entry + 1 >= aRender->line_capacity) {
+        aRender->line_capacity = aRender->line_capacity == 0 ? 1024 : 2 * aRender->line_capacity;
+        aRender->line = render_realloc(aRender, aRender->line, aRender->line_capacity * sizeof *aRender->line);
+    }
+    if (step == 1 && rows > 0)
+        aRender->line[rows - 1].width = aRender->line_width;
+    aRender->line[entry].offset = aOffset;
+    aRender->line[entry].column = aColumn;
+    aRender->line[entry].width = 0;
+    aRender->line_width = 0;
 }
 
-// Parse one line of font hex data and store result in glyph.
+// Find the drawn rows that repeat an earlier drawn row. Not used when
+// streaming, see fb_stream_rows().
 //
-void parse_font_line(const char *aLine, int aLineNr, struct glyph *aGlyph) {
-    char    c;
-    uint32_t codepoint;
-    if (sscanf(aLine, "%" SCNx32 "%c", &codepoint, &c) == 2 && c == ':') {
-        const char *colon = strchr(aLine, ':');
-        const size_t len = strlen(colon + 1);
-        unsigned int bytes = gHeight;
-        if (len == gHeight * gDblBytes * 2 + 1)
-            bytes *= gDblBytes;
-        else if (len == gHeight * gBytes * 2 + 1)
-            bytes *= gBytes;
-        else
-            errx("unexpected length of hex data\n");
-
-        aGlyph->codepoint = (wint_t) codepoint;
-        aGlyph->bitmap = xmalloc(bytes);
-        aGlyph->cells = (bytes == gHeight * gBytes ? 1 : 2);
-        // Convert nybbles to bytes.
-        const char *hex = colon + 1;
-        for (unsigned int i = 0; i < 2 * bytes; i += 2) {
-            if (!isxdigit(hex[i]) || !isxdigit(hex[i + 1]))
-                errx("invalid byte '%c%c' in file %s, line %d\n", hex[i], hex[i + 1], gFontFilename, aLineNr);
-            aGlyph->bitmap[i / 2] = (hex_value(hex[i]) << 4) + hex_value(hex[i + 1]);
+void dedup_rows(struct render *aRender) {
+    const unsigned int rows = aRender->rows;
+    aRender->row_source = render_malloc(aRender, (rows > 0 ? rows : 1) * sizeof *aRender->row_source);
+    if (aRender->options->stats != STATS_OFF)
+        aRender->row_stats = render_malloc(aRender, (rows > 0 ? rows : 1) * sizeof *aRender->row_stats);
+    for (unsigned int row = 0; row < rows; ++row) {
+        const struct line *const line = &aRender->line[aRender->first_row + row];
+        dedup_row(aRender, row, line->offset, line[1].offset, line->column,
+                  line[1].offset > line->offset && aRender->text[line[1].offset - 1] == '\n');
+    }
+}
+
+// Note in row_source whether drawn row aRow, which spans aStart to aEnd of
+// the text, starts at aColumn and ends with a newline if aNewline, repeats
+// an earlier row it can be copied from.
+//
+void dedup_row(struct render *aRender, unsigned int aRow, size_t aStart, size_t aEnd, unsigned int aColumn,
+               bool aNewline) {
+    unsigned int source = aRow;
+
+    if (aColumn == 0 && aNewline) {
+        source = dedup_lookup(aRender, aRow, aStart, aEnd - aStart);
+        if (aRender->options->threads > 1 && source < aRow / BAND_ROWS * BAND_ROWS)
+            source = aRow;
+    }
+    aRender->row_source[aRow] = source;
+    if (source != aRow)
+        ++aRender->tally.rows_copied;
+}
+
+// Look up the row of aLength bytes at aOffset in row_table. Return the most
+// recent row with the same bytes, or aRow if there is none. Either way,
+// aRow becomes the most recent one.
+//
+unsigned int dedup_lookup(struct render *aRender, unsigned int aRow, size_t aOffset, size_t aLength) {
+    const uint8_t *const text = aRender->text;
+    if (2 * (aRender->row_table_used + 1) > aRender->row_table_size) {
+        struct row_key *const old = aRender->row_table;
+        const size_t old_size = aRender->row_table_size;
+        const size_t size = old_size == 0 ? 1024 : 2 * old_size;
+        struct row_key *const table = render_malloc(aRender, size * sizeof *table);
+        memset(table, 0, size * sizeof *table);
+        for (size_t i = 0; i < old_size; ++i)
+            if (old[i].length != 0) {
+                size_t  slot = old[i].hash & (size - 1);
+                while (table[slot].length != 0)
+                    slot = (slot + 1) & (size - 1);
+                table[slot] = old[i];
+            }
+        free(old);
+        aRender->row_table = table;
+        aRender->row_table_size = size;
+    }
+
+    struct row_key *const table = aRender->row_table;
+    const size_t mask = aRender->row_table_size - 1;
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);       // FNV-1a
+    for (size_t i = 0; i < aLength; ++i)
+        hash = (hash ^ text[aOffset + i]) * UINT64_C(0x100000001b3);
+    size_t  slot = hash & mask;
+    while (table[slot].length != 0) {
+        struct row_key *const key = &table[slot];
+        if (key->hash == hash && key->length == aLength && memcmp(text + key->offset, text + aOffset, aLength) == 0) {
+            const unsigned int source = key->row;
+            key->row = aRow;
+            key->offset = aOffset;
+            return source;
         }
+        slot = (slot + 1) & mask;
     }
-    else
-        errx("expected codepoint:hexdata in file %s, line %d\n", gFontFilename, aLineNr);
+    table[slot].hash = hash;
+    table[slot].offset = aOffset;
+    table[slot].length = aLength;
+    table[slot].row = aRow;
+    ++aRender->row_table_used;
+    return aRow;
+}
+
+// Lay out the text as decoded by fgetwc() in the current locale. The file
+// stays open and is read again while drawing. Return the number of
+// codepoints.
+//
+size_t layout_text_locale(struct render *aRender) {
+    const char *const filename = aRender->options->text_filename;
+    size_t  chars = 0;
+    unsigned int column = 0;
+    wint_t  wc;
+
+    if (strcmp(filename, "-") == 0)
+        errx("-L reads the text twice and can't read it from standard input\n");
+    aRender->text_file = xfopen(filename, "rb");
+    if (fseek(aRender->text_file, 0, SEEK_SET) != 0)
+        errx("-L reads the text twice and needs a seekable file, not %s\n", filename);
+    while ((wc = fgetwc(aRender->text_file)) != WEOF) {
+        layout_char(aRender, wc, &column);
+        ++chars;
+    }
+    aRender->text_bytes = (size_t) ftell(aRender->text_file);
+    rewind(aRender->text_file);
+    return chars;
+}
+
+// Account for one character in rows, columns and the current column.
+//
+void layout_char(struct render *aRender, wint_t aChar, unsigned int *aColumn) {
+    const int width = cell_width((uint32_t) aChar);
+    if (aRender->options->miss_report && width >= 0)
+        count_missing(aRender, aChar);
+    switch (width) {
+    case -1:
+        /* Control character. A few influence row and column. */
+        if (aChar == L'\t') {
+            *aColumn += aRender->options->tabstop;
+            *aColumn -= (*aColumn % aRender->options->tabstop);
+        }
+        else if (aChar == L'\n') {
+            if (*aColumn > aRender->line_width)
+                aRender->line_width = *aColumn;
+            ++aRender->rows;
+            if (*aColumn > aRender->columns)
+                aRender->columns = *aColumn;
+            *aColumn = 0;
+        }
+        else if (aChar == L'\v' || aChar == L'\f') {
+            /* Handle \v and \f like xterm: advance to next row. */
+            if (*aColumn > aRender->line_width)
+                aRender->line_width = *aColumn;
+            ++aRender->rows;
+        }
+        else if (aChar == L'\r') {
+            if (*aColumn > aRender->line_width)
+                aRender->line_width = *aColumn;
+            if (*aColumn > aRender->columns)
+                aRender->columns = *aColumn;
+            *aColumn = 0;
+        }
+        else
+            fprintf(stderr, "ignoring width=-1 character U+%04x in row %u\n", (unsigned int) aChar, aRender->rows + 1);
+        break;
+    case 0:
+        /* Combining character, zero width space, ... */
+        break;
+    case 1:
+        /* Ordinary character. */
+        ++*aColumn;
+        break;
+    case 2:
+        /* Double width character. */
+        *aColumn += 2;
+        break;
+    default:
+        errx("unexpected cell_width(U+%04x)=%d\n", (unsigned int) aChar, width);
+        break;
+    }
+}
+
+// Return the character of the text at *aPos, advancing *aPos past it, or
+// WEOF at the end of the text. With -L, read from text_file instead.
+//
+wint_t text_getwc(struct render *aRender, const uint8_t **aPos) {
+    if (aRender->text_file != NULL)
+        return fgetwc(aRender->text_file);
+    const uint8_t *const end = aRender->text + aRender->text_bytes;
+    if (*aPos == end)
+        return WEOF;
+    if (**aPos < 0x80)
+        return *(*aPos)++;
+    return (wint_t) utf8_decode(aPos, end);
+}
+
+// Save the frame buffer as a PNG image.
+//
+void fb_save_png(struct render *aRender) {
+    fb_png_begin(aRender);
+    const double start = seconds();
+    for (size_t line = 0; line < (size_t) aRender->glyphset->height * aRender->rows; ++line)
+        fb_png_write_row(aRender, aRender->framebuffer[line]);
+    fb_png_end(aRender);
+    if (aRender->options->stats != STATS_OFF)
+        fprintf(aRender->options->info, "encoded in %.3f s\n", seconds() - start);
+}
+
+// Write the single row frame buffer's scan lines as the next rows of the
+// PNG image, then clear it for the next text row unless that repeats this
+// one (aKeep).
+//
+void fb_write_band(struct render *aRender, bool aKeep) {
+    for (unsigned int line = 0; line < aRender->glyphset->height; ++line)
+        fb_png_write_row(aRender, aRender->framebuffer[line]);
+    if (!aKeep)
+        memset(aRender->framebuffer[0], aRender->options->inverted ? 0xFF : 0, aRender->slab_bytes);
+}
+
+// Create the PNG file, and with -I the complementary one, and write
+// everything up to the image rows.
+//
+void fb_png_begin(struct render *aRender) {
+    const struct options *const options = aRender->options;
+    const struct glyphset *const glyphset = aRender->glyphset;
+    aRender->sink[0].filename = options->png_filename;
+    aRender->sink[1].filename = options->complement_filename;
+    aRender->sinks = options->complement_filename != NULL ? 2 : 1;
+    if (aRender->sinks == 2)
+        aRender->complement = render_malloc(aRender, aRender->stride > 0 ? aRender->stride : 1);
+    for (unsigned int i = 0; i < aRender->sinks; ++i) {
+        struct png_sink *const sink = &aRender->sink[i];
+        sink->file = strcmp(sink->filename, "-") == 0 ? stdout : xfopen(sink->filename, "wb");
+        sink->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, fb_png_error, NULL);
+        if (!sink->png)
+            errx("png_create_write_struct failed\n");
+
+        sink->info = png_create_info_struct(sink->png);
+        if (!sink->info)
+            errx("png_create_info_struct failed\n");
+
+        sink->bytes = 0;
+        png_set_write_fn(sink->png, sink, fb_png_write_data, fb_png_flush);
+        // Long texts easily exceed libpng's default limit of 1000000 rows.
+        png_set_user_limits(sink->png, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        if (options->png_level != -1)
+            png_set_compression_level(sink->png, options->png_level);
+        if (options->png_strategy != -1)
+            png_set_compression_strategy(sink->png, options->png_strategy);
+        if (options->png_filters != -1)
+            png_set_filter(sink->png, PNG_FILTER_TYPE_BASE, options->png_filters);
+        if (options->png_window_bits != -1)
+            png_set_compression_window_bits(sink->png, options->png_window_bits);
+        if (options->png_mem_level != -1)
+            png_set_compression_mem_level(sink->png, options->png_mem_level);
+        png_set_IHDR(sink->png, sink->info, glyphset->width * aRender->columns, glyphset->height * aRender->rows, 1,
+                     PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        png_write_info(sink->png, sink->info);
+    }
+}
+
+// Write one scan line as the next image row, complemented for sink[1].
+//
+void fb_png_write_row(struct render *aRender, png_bytep aLine) {
+    png_write_row(aRender->sink[0].png, aLine);
+    if (aRender->sinks == 2) {
+        png_bytep const complement = aRender->complement;
+        for (size_t i = 0; i < aRender->stride; ++i)
+            complement[i] = (uint8_t) ~aLine[i];
+        png_write_row(aRender->sink[1].png, complement);
+    }
+}
+
+// Finish the PNG files once all image rows have been written.
+//
+void fb_png_end(struct render *aRender) {
+    const struct glyphset *const glyphset = aRender->glyphset;
+    for (unsigned int i = 0; i < aRender->sinks; ++i) {
+        struct png_sink *const sink = &aRender->sink[i];
+        png_write_end(sink->png, NULL);
+        png_destroy_write_struct(&sink->png, &sink->info);
+        if (sink->file == stdout ? fflush(stdout) != 0 || ferror(stdout) : fclose(sink->file) != 0)
+            errx("can't close %s: %s\n", sink->filename, strerror(errno));
+        aRender->tally.png_bytes += sink->bytes;
+        fprintf(aRender->options->info, "wrote WxH = %ux%u image to %s\n", glyphset->width * aRender->columns,
+                glyphset->height * aRender->rows, sink->filename);
+    }
+    free(aRender->complement);
+    aRender->complement = NULL;
+}
+
+// Write callback for libpng, counting the bytes of the PNG file.
+//
+void fb_png_write_data(png_structp aPng, png_bytep aData, size_t aLength) {
+    struct png_sink *const sink = png_get_io_ptr(aPng);
+    if (fwrite(aData, 1, aLength, sink->file) != aLength)
+        errx("can't write %s: %s\n", sink->filename, strerror(errno));
+    sink->bytes += aLength;
+}
+
+// Flush callback for libpng.
+//
+void fb_png_flush(png_structp aPng) {
+    const struct png_sink *const sink = png_get_io_ptr(aPng);
+    fflush(sink->file);
+}
+
+// Error callback for libpng. Must not return.
+//
+void fb_png_error(png_structp aPng, png_const_charp aMessage) {
+    (void) aPng;
+    errx("fatal png error: %s\n", aMessage);
+}
+
+// Allocate frame buffer to hold the pixels. White on black, unless inverted.
+// All scan lines live in a single cache line aligned slab. The stride is
+// padded to whole cache lines, which leaves slack at the end of each line.
+//
+void fb_alloc(struct render *aRender, unsigned int aHeight, unsigned int aWidth, unsigned int aRows,
+              unsigned int aColumns, bool aInverted) {
+    const size_t fb_lines = (size_t) aHeight * aRows;
+    aRender->fb_rows = aRows;
+    aRender->framebuffer = render_malloc(aRender, fb_lines * sizeof *aRender->framebuffer);
+
+    const size_t fb_pixels_per_line = (size_t) aWidth * aColumns;
+    const size_t fb_bytes_per_line = (fb_pixels_per_line + 7) / 8;
+    const size_t stride = (fb_bytes_per_line + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if (stride != 0 && fb_lines > (SIZE_MAX - CACHE_LINE) / stride)
+        errx("frame buffer of %zu x %zu bytes is too large\n", fb_lines, stride);
+    aRender->stride = stride;
+    aRender->slab = render_malloc(aRender, fb_lines * stride + CACHE_LINE - 1);
+    uint8_t *const lines = aRender->slab + (CACHE_LINE - (uintptr_t) aRender->slab % CACHE_LINE) % CACHE_LINE;
+    aRender->slab_bytes = fb_lines * stride;
+    memset(lines, aInverted ? 0xFF : 0, aRender->slab_bytes);
+    for (size_t line = 0; line < fb_lines; ++line)
+        aRender->framebuffer[line] = lines + line * stride;
 }
 
-// Compute value of aXdigit.
+// Release the frame buffer.
 //
-uint8_t hex_value(char aXdigit) {
-    uint8_t h = (uint8_t) aXdigit;
-    if ((h >= '0') && (h <= '9'))
-        return h - '0';
-    if ((h >= 'A') && (h <= 'F'))
-        return (h - 'A') + 10;
-    if ((h >= 'a') && (h <= 'f'))
-        return (h - 'a') + 10;
-    return 0xFFu;
+void fb_free(struct render *aRender) {
+    free(aRender->framebuffer);
+    free(aRender->slab);
+    aRender->framebuffer = NULL;
+    aRender->slab = NULL;
 }
 
-// Compare callback for qsort and bsearch.
+// Load the glyphset's font from aFilename: a gallant font image, hex or src
+// format. With BUILTIN_FONT, the name builtin selects the compiled in font.
 //
-int compare_glyphs(const void *aFirst, const void *aSecond) {
-    const struct glyph *first = aFirst, *second = aSecond;
-    return first->codepoint - second->codepoint;
+void load_font(struct glyphset *aGlyphset, const char *aFilename) {
+    char    error[FONT_ERROR_SIZE] = "";
+    struct font *font;
+#ifdef BUILTIN_FONT
+    if (strcmp(aFilename, FontFilename) == 0)
+        font = font_from_tables(BUILTIN_WIDTH, BUILTIN_HEIGHT, BUILTIN_GLYPHS, builtin_codepoints, builtin_cells,
+                                builtin_offsets, builtin_bitmaps, sizeof builtin_bitmaps, aFilename, error);
+    else
+#endif
+        font = font_open(aFilename, error);
+    if (font == NULL)
+        errx("%s\n", error);
+    if (error[0] != '\0')
+        fprintf(stderr, "%s\n", error);
+    memset(aGlyphset, 0, sizeof *aGlyphset);
+    aGlyphset->font = font;
+    aGlyphset->width = font->width;
+    aGlyphset->height = font->height;
+    aGlyphset->bytes = font->bytes;
+    aGlyphset->dbl_bytes = font->dbl_bytes;
+    aGlyphset->glyphs = font->glyphs;
+    aGlyphset->replacement = font->replacement;
+    fprintf(stderr, "found %u glyphs, width %u, height %u in %s\n", font->glyphs, font->width, font->height, aFilename);
+    shift_cache_init(aGlyphset);
+}
+
+// Release the glyphset's font and shifted glyph cache.
+//
+void unload_font(struct glyphset *aGlyphset) {
+    while (aGlyphset->chunks != NULL) {
+        struct shift_chunk *const chunk = aGlyphset->chunks;
+        aGlyphset->chunks = chunk->next;
+        free(chunk);
+    }
+    free(aGlyphset->shifted);
+    pthread_mutex_destroy(&aGlyphset->lock);
+    font_close(aGlyphset->font);
+    memset(aGlyphset, 0, sizeof *aGlyphset);
 }
 
 // Draw a codepoint's glyph into the frame buffer at the given position.
+// The glyph's rows come pre-shifted to the bit position of the column, so
+// each row is merged byte by byte into the scan line with OR (AND-NOT when
+// inverted).
+//
+void fb_draw_glyph(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn) {
+    struct glyphset *const glyphset = aRender->glyphset;
+    const unsigned int g = lookup_glyph(glyphset, aCodepoint);
+    const unsigned int height = glyphset->height;
+    const unsigned int xpos = glyphset->width * aColumn;
+    const unsigned int shift = xpos % 8;
+    const unsigned int span = (shift + glyphset->width * glyphset->font->cells[g] + 7) / 8;    // Scan line bytes touched.
+    const uint8_t *rows = shifted_rows(glyphset, g, shift);
+    if (aRender->options->inverted)
+        for (unsigned int i = 0; i < height; ++i) {
+            uint8_t *const line = aLines[i] + xpos / 8;
+            for (unsigned int b = 0; b < span; ++b)
+                line[b] &= (uint8_t) ~rows[b];
+            rows += span;
+        }
+    else
+        for (unsigned int i = 0; i < height; ++i) {
+            uint8_t *const line = aLines[i] + xpos / 8;
+            for (unsigned int b = 0; b < span; ++b)
+                line[b] |= rows[b];
+            rows += span;
+        }
+}
+
+// Draw a codepoint's glyph into the frame buffer at the given position, one
+// pixel at a time. Slow, but simple enough to serve as reference for
+// fb_draw_glyph().
 //
-void fb_draw_glyph(wint_t aCodepoint, unsigned int aRow, unsigned int aColumn) {
-    const struct glyph *g = lookup_glyph(aCodepoint);
-    const uint8_t *bitmap = g->bitmap;
-    unsigned int ypos = gHeight * aRow;
-    for (unsigned int i = 0; i < gHeight; ++i) {
-        unsigned int xpos = gWidth * aColumn;
+void fb_draw_glyph_pixels(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn) {
+    const struct glyphset *const glyphset = aRender->glyphset;
+    const unsigned int g = lookup_glyph(glyphset, aCodepoint);
+    const uint8_t *bitmap = font_bitmap(glyphset->font, g);
+    const unsigned int cells = glyphset->font->cells[g];
+    for (unsigned int i = 0; i < glyphset->height; ++i) {
+        unsigned int xpos = glyphset->width * aColumn;
         uint8_t mask = 128;
-        for (unsigned int p = 0; p < gWidth * g->cells; ++p) {
+        for (unsigned int p = 0; p < glyphset->width * cells; ++p) {
             // get pixel p from bitmap
             // byte = p/8; bit = 7 - p%8
             if (bitmap[p / 8] & mask)
-                fb_draw_pixel(xpos, ypos);
+                fb_draw_pixel(aRender, aLines[i], xpos);
             if ((mask >>= 1) == 0)
                 mask = 128;
             ++xpos;
         }
-        bitmap += (g->cells == 1) ? gBytes : gDblBytes;
-        ++ypos;
+        bitmap += (cells == 1) ? glyphset->bytes : glyphset->dbl_bytes;
     }
 }
 
-// Set pixel (aXpos, aYpos) in the frame buffer.
+// Draw a codepoint's glyph at text column aColumn, clipped to the -c
+// window. Glyphs entirely inside go to draw_inside; those straddling an
+// edge, like a double width glyph split by it, are drawn pixel by pixel.
 //
-void fb_draw_pixel(unsigned int aXpos, unsigned int aYpos) {
+void fb_draw_glyph_clipped(struct render *aRender, wint_t aCodepoint, png_bytep *aLines, unsigned int aColumn) {
+    const struct glyphset *const glyphset = aRender->glyphset;
+    const unsigned int g = lookup_glyph(glyphset, aCodepoint);
+    const unsigned int cells = glyphset->font->cells[g];
+    const unsigned int first = aRender->first_column;
+    if (aColumn >= first && aColumn - first + cells <= aRender->columns) {
+        aRender->draw_inside(aRender, aCodepoint, aLines, aColumn - first);
+        return;
+    }
+    const long x0 = ((long) aColumn - (long) first) * glyphset->width;
+    const long x1 = x0 + (long) (glyphset->width * cells);
+    const long xmax = (long) glyphset->width * aRender->columns;
+    if (x1 <= 0 || x0 >= xmax)
+        return;
+    const uint8_t *bitmap = font_bitmap(glyphset->font, g);
+    for (unsigned int i = 0; i < glyphset->height; ++i) {
+        for (long x = x0 > 0 ? x0 : 0; x < x1 && x < xmax; ++x) {
+            const unsigned int p = (unsigned int) (x - x0);
+            if (bitmap[p / 8] & (128u >> p % 8))
+                fb_draw_pixel(aRender, aLines[i], (unsigned int) x);
+        }
+        bitmap += (cells == 1) ? glyphset->bytes : glyphset->dbl_bytes;
+    }
+}
+
+// Set pixel aXpos in scan line aLine.
+//
+void fb_draw_pixel(const struct render *aRender, png_bytep aLine, unsigned int aXpos) {
     const uint8_t mask = 1u << (7 - (aXpos % 8));
-    if (gInverted)
-        gFramebuffer[aYpos][aXpos / 8] &= ~mask;
+    if (aRender->options->inverted)
+        aLine[aXpos / 8] &= ~mask;
     else
-        gFramebuffer[aYpos][aXpos / 8] |= mask;
+        aLine[aXpos / 8] |= mask;
+}
+
+// Return the index of a codepoint's glyph or, if not found, of the
+// replacement character.
+//
+unsigned int lookup_glyph(const struct glyphset *aGlyphset, wint_t aCodepoint) {
+    return font_lookup(aGlyphset->font, (uint32_t) aCodepoint);
 }
 
-// Return pointer to glyph data or, if not found, of the replacement character.
+// Set up the empty shifted glyph cache for the loaded font.
 //
-struct glyph *lookup_glyph(wint_t aCodepoint) {
-    struct glyph key = { 0 };
+void shift_cache_init(struct glyphset *aGlyphset) {
+    aGlyphset->phase_step = 8;
+    while (aGlyphset->width % aGlyphset->phase_step != 0)
+        aGlyphset->phase_step /= 2;
+    aGlyphset->phases = 8 / aGlyphset->phase_step;
+    const size_t size = (size_t) (aGlyphset->glyphs + 1) * aGlyphset->phases * sizeof *aGlyphset->shifted;
+    aGlyphset->shifted = xmalloc(size);
+    memset(aGlyphset->shifted, 0, size);
+    aGlyphset->bytes_allocated += size;
+    pthread_mutex_init(&aGlyphset->lock, NULL);
+}
+
+// Return aGlyph's rows shifted right by aShift bits, building them on first
+// use. Built rows never change, so only building takes the lock.
+//
+const uint8_t *shifted_rows(struct glyphset *aGlyphset, unsigned int aGlyph, unsigned int aShift) {
+    const uint8_t **const slot = &aGlyphset->shifted[(size_t) aGlyph * aGlyphset->phases + aShift / aGlyphset->phase_step];
+    const uint8_t *rows = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (rows == NULL) {
+        pthread_mutex_lock(&aGlyphset->lock);
+        rows = *slot;
+        if (rows == NULL) {
+            rows = shift_glyph(aGlyphset, aGlyph, aShift);
+            __atomic_store_n(slot, rows, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&aGlyphset->lock);
+    }
+    return rows;
+}
 
-    key.codepoint = aCodepoint;
-    struct glyph *const p = bsearch(&key, gGlyphset, gGlyphs, sizeof *gGlyphset, compare_glyphs);
-    return p != NULL ? p : gReplacement;
+// Copy aGlyph's rows shifted right by aShift bits, each row widened to the
+// scan line bytes it touches. Padding bits of the bitmap are dropped. Must
+// be called with the glyphset's lock held.
+//
+const uint8_t *shift_glyph(struct glyphset *aGlyphset, unsigned int aGlyph, unsigned int aShift) {
+    const unsigned int height = aGlyphset->height;
+    const unsigned int pixels = aGlyphset->width * aGlyphset->font->cells[aGlyph];
+    const unsigned int bytes = (pixels + 7) / 8;
+    const unsigned int span = (aShift + pixels + 7) / 8;
+    const size_t size = (size_t) span * height;
+    if (size > aGlyphset->chunk_free) {
+        const size_t chunk_size = size > SHIFT_CHUNK ? size : SHIFT_CHUNK;
+        struct shift_chunk *const chunk = xmalloc(sizeof *chunk + chunk_size);
+        chunk->next = aGlyphset->chunks;
+        aGlyphset->chunks = chunk;
+        aGlyphset->chunk_next = chunk->rows;
+        aGlyphset->chunk_free = chunk_size;
+        aGlyphset->bytes_allocated += sizeof *chunk + chunk_size;
+    }
+    uint8_t *const shifted = aGlyphset->chunk_next;
+    aGlyphset->chunk_next += size;
+    aGlyphset->chunk_free -= size;
+    ++aGlyphset->shifted_glyphs;
+    aGlyphset->shifted_bytes += size;
+
+    const uint8_t *bitmap = font_bitmap(aGlyphset->font, aGlyph);
+    const uint8_t last = (uint8_t) (0xFF << (8 * bytes - pixels));
+    uint8_t *row = shifted;
+    for (unsigned int i = 0; i < height; ++i) {
+        unsigned int carry = 0;
+        for (unsigned int b = 0; b < span; ++b) {
+            const unsigned int in = b < bytes ? (b == bytes - 1 ? bitmap[b] & last : bitmap[b]) : 0;
+            row[b] = (uint8_t) ((carry << (8 - aShift)) | (in >> aShift));
+            carry = in;
+        }
+        bitmap += bytes;
+        row += span;
+    }
+    return shifted;
 }
 
 // Open file and exit on failure.
@@ -524,6 +1887,207 @@ void   *xmalloc(size_t aSize) {
     return mem;
 }
 
+// Resize memory and exit on failure.
+//
+void   *xrealloc(void *aMem, size_t aSize) {
+    void   *const mem = realloc(aMem, aSize);
+    if (mem == NULL)
+        errx("failed to allocate %zu bytes\n", aSize);
+    return mem;
+}
+
+// Return wall clock seconds from an arbitrary starting point.
+//
+double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Start timing a phase.
+//
+void phase_begin(struct tally *aTally) {
+    aTally->phase_start_wall = seconds();
+    aTally->phase_start_cpu = clock();
+}
+
+// Add the time since phase_begin() to aPhase.
+//
+void phase_end(struct tally *aTally, enum phase aPhase) {
+    aTally->phase_wall[aPhase] += seconds() - aTally->phase_start_wall;
+    aTally->phase_cpu[aPhase] += (double) (clock() - aTally->phase_start_cpu) / CLOCKS_PER_SEC;
+}
+
+// Add the times, counters and misses of aTally to aTotal, moving or
+// freeing aTally's pages of misses.
+//
+void tally_add(struct tally *aTotal, struct tally *aTally) {
+    for (unsigned int i = 0; i < PHASES; ++i) {
+        aTotal->phase_wall[i] += aTally->phase_wall[i];
+        aTotal->phase_cpu[i] += aTally->phase_cpu[i];
+    }
+    draw_stats_add(&aTotal->draw, &aTally->draw);
+    aTotal->rows_copied += aTally->rows_copied;
+    aTotal->decoded_bytes += aTally->decoded_bytes;
+    aTotal->decode_cpu += aTally->decode_cpu;
+    aTotal->bytes_allocated += aTally->bytes_allocated;
+    aTotal->png_bytes += aTally->png_bytes;
+    for (uint32_t p = 0; p < FONT_PAGES; ++p) {
+        unsigned int *const page = aTally->misses[p];
+        if (page == NULL)
+            continue;
+        if (aTotal->misses[p] == NULL)
+            aTotal->misses[p] = page;
+        else {
+            for (uint32_t s = 0; s < FONT_SLOTS; ++s)
+                aTotal->misses[p][s] += page[s];
+            free(page);
+        }
+        aTally->misses[p] = NULL;
+    }
+}
+
+// Release aTally's pages of misses.
+//
+void tally_free(struct tally *aTally) {
+    for (uint32_t p = 0; p < FONT_PAGES; ++p) {
+        free(aTally->misses[p]);
+        aTally->misses[p] = NULL;
+    }
+}
+
+// Count a glyph about to be drawn, and the pixels it sets.
+//
+void count_glyph(const struct glyphset *aGlyphset, wint_t aCodepoint, struct draw_stats *aStats) {
+    const struct font *const font = aGlyphset->font;
+    const unsigned int g = lookup_glyph(aGlyphset, aCodepoint);
+    ++aStats->lookups;
+    if (g == aGlyphset->replacement && (uint32_t) aCodepoint != font->codepoint[g])
+        ++aStats->replacements;
+    const size_t bytes = (size_t) aGlyphset->height * font_row_bytes(font, g);
+    const unsigned int pixels = aGlyphset->width * font->cells[g];
+    const uint8_t last = (uint8_t) (0xFF << ((pixels + 7) / 8 * 8 - pixels));
+    const uint8_t *const bitmap = font_bitmap(font, g);
+    for (size_t i = 0; i < bytes; ++i) {
+        unsigned int b = (i + 1) % ((pixels + 7) / 8) == 0 ? bitmap[i] & last : bitmap[i];
+        for (; b != 0; b &= b - 1)
+            ++aStats->pixels;
+    }
+}
+
+// Add the counts of aStats to aTotal.
+//
+void draw_stats_add(struct draw_stats *aTotal, const struct draw_stats *aStats) {
+    aTotal->lookups += aStats->lookups;
+    aTotal->replacements += aStats->replacements;
+    aTotal->pixels += aStats->pixels;
+}
+
+// Add what a thread of aRender drew and copied, counted in aStats, to the
+// render's tally.
+//
+void count_drawn(struct render *aRender, const struct draw_stats *aStats) {
+    pthread_mutex_lock(&aRender->band_lock);
+    draw_stats_add(&aRender->tally.draw, aStats);
+    pthread_mutex_unlock(&aRender->band_lock);
+}
+
+// Count aCodepoint if the font has no glyph for it. U+FFFD, which malformed
+// UTF-8 decodes to, always counts as present.
+//
+void count_missing(struct render *aRender, wint_t aCodepoint) {
+    const struct glyphset *const glyphset = aRender->glyphset;
+    const uint32_t codepoint = (uint32_t) aCodepoint;
+    if (codepoint >= FONT_MAX_CODEPOINT || codepoint == glyphset->font->codepoint[glyphset->replacement]
+        || lookup_glyph(glyphset, aCodepoint) != glyphset->replacement)
+        return;
+    unsigned int **const page = &aRender->tally.misses[codepoint >> FONT_SLOT_BITS];
+    if (*page == NULL) {
+        *page = render_malloc(aRender, FONT_SLOTS * sizeof **page);
+        memset(*page, 0, FONT_SLOTS * sizeof **page);
+    }
+    ++(*page)[codepoint & (FONT_SLOTS - 1)];
+}
+
+// Print the codepoints missing from the font, most used first, with how
+// often the text used them.
+//
+void report_missing(const struct options *aOptions, const struct tally *aTotal) {
+    struct miss *misses = NULL;
+    size_t  nmisses = 0, capacity = 0, total = 0;
+    for (uint32_t p = 0; p < FONT_PAGES; ++p) {
+        const unsigned int *const page = aTotal->misses[p];
+        if (page == NULL)
+            continue;
+        for (uint32_t s = 0; s < FONT_SLOTS; ++s) {
+            if (page[s] == 0)
+                continue;
+            if (nmisses == capacity) {
+                capacity = capacity == 0 ? 256 : 2 * capacity;
+                misses = xrealloc(misses, capacity * sizeof *misses);
+            }
+            misses[nmisses].codepoint = p << FONT_SLOT_BITS | s;
+            misses[nmisses++].count = page[s];
+            total += page[s];
+        }
+    }
+    qsort(misses, nmisses, sizeof *misses, compare_misses);
+    fprintf(aOptions->info, "%zu codepoints missing from %s, used %zu times\n", nmisses, aOptions->font_filename, total);
+    for (size_t i = 0; i < nmisses; ++i)
+        fprintf(aOptions->info, "U+%04" PRIX32 " %u\n", misses[i].codepoint, misses[i].count);
+    free(misses);
+}
+
+// Compare callback for qsort: higher count first, then lower codepoint.
+//
+int compare_misses(const void *aFirst, const void *aSecond) {
+    const struct miss *first = aFirst, *second = aSecond;
+    if (first->count != second->count)
+        return (first->count < second->count) - (first->count > second->count);
+    return (first->codepoint > second->codepoint) - (first->codepoint < second->codepoint);
+}
+
+// Print the phase times, counters and the text decoding rate on stderr, as
+// text (-v) or as a JSON object on a single line (-J).
+//
+void report_stats(const struct options *aOptions, const struct glyphset *aGlyphset, const struct tally *aTotal) {
+    const struct {
+        const char *name;
+        size_t  value;
+    } counters[] = {
+        { "glyph_lookups", aTotal->draw.lookups },
+        { "replacement_glyphs", aTotal->draw.replacements },
+        { "pixels_set", aTotal->draw.pixels },
+        { "rows_copied", aTotal->rows_copied },
+        { "shifted_glyphs", aGlyphset->shifted_glyphs },
+        { "shifted_cache_bytes",
+          aGlyphset->shifted_bytes + (size_t) (aGlyphset->glyphs + 1) * aGlyphset->phases * sizeof *aGlyphset->shifted },
+        { "text_bytes_decoded", aTotal->decoded_bytes },
+        { "bytes_allocated", aTotal->bytes_allocated + aGlyphset->bytes_allocated },
+        { "png_bytes_written", aTotal->png_bytes },
+    };
+    const size_t ncounters = sizeof counters / sizeof counters[0];
+    const double decode_rate = aTotal->decode_cpu > 0 ? (double) aTotal->decoded_bytes / aTotal->decode_cpu / 1e6 : 0.0;
+
+    if (aOptions->stats == STATS_JSON) {
+        fprintf(stderr, "{\"phases\":{");
+        for (unsigned int i = 0; i < PHASES; ++i)
+            fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i > 0 ? "," : "",
+                    gPhaseName[i], aTotal->phase_wall[i], aTotal->phase_cpu[i]);
+        fprintf(stderr, "},\"counters\":{");
+        for (size_t i = 0; i < ncounters; ++i)
+            fprintf(stderr, "%s\"%s\":%zu", i > 0 ? "," : "", counters[i].name, counters[i].value);
+        fprintf(stderr, "},\"decode_mb_per_s\":%.1f}\n", decode_rate);
+        return;
+    }
+    fprintf(stderr, "%-20s %10s %10s\n", "phase", "wall s", "cpu s");
+    for (unsigned int i = 0; i < PHASES; ++i)
+        fprintf(stderr, "%-20s %10.6f %10.6f\n", gPhaseName[i], aTotal->phase_wall[i], aTotal->phase_cpu[i]);
+    for (size_t i = 0; i < ncounters; ++i)
+        fprintf(stderr, "%-20s %21zu\n", counters[i].name, counters[i].value);
+    fprintf(stderr, "%-20s %21.1f\n", "decode_mb_per_s", decode_rate);
+}
+
 // Print formatted message on stderr and exit.
 //
 void errx(const char *aFormat, ...) {
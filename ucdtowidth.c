@@ -0,0 +1,366 @@
+/*
+ * NAME
+ *     ucdtowidth - generate the cell width table from the Unicode data files
+ *
+ * EXAMPLE USAGE
+ *     ucdtowidth UnicodeData.txt EastAsianWidth.txt DerivedCoreProperties.txt > cellwidth.c
+ *
+ * DESCRIPTION
+ *     Writes C source for cell_width(), a three-stage table lookup that
+ *     classifies every codepoint the way wcwidth() does in a UTF-8 locale:
+ *     -1 for control, unassigned and surrogate codepoints, 0 for
+ *     combining and format characters, 2 for East Asian Wide and
+ *     Fullwidth characters and 1 for everything else. The rules follow
+ *     those glibc uses to generate its UTF-8 locale, so the table agrees
+ *     with glibc's wcwidth() for the same Unicode version, but not with
+ *     whatever the C library of the host happens to use.
+ *
+ *     The table is split into blocks of 256 codepoints, each made of 16
+ *     chunks of 16 codepoints. Identical chunks and blocks are stored once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef VERSION
+#define VERSION "(undefined)"
+#endif
+
+#define MAX_CODEPOINT 0x110000
+#define MAX_LINE 1024
+#define CHUNK 16                       // Codepoints per chunk.
+#define BLOCK (CHUNK * CHUNK)          // Codepoints per block.
+#define BLOCKS (MAX_CODEPOINT / BLOCK)
+
+/* Width classes, stored in the table as width + 1. */
+#define UNPRINTABLE (-1)
+#define ZERO_WIDTH 0
+#define SINGLE_WIDTH 1
+#define DOUBLE_WIDTH 2
+
+void    usage(int aStatus);
+void    errx(const char *aFormat, ...);
+void   *xmalloc(size_t aSize);
+FILE   *xfopen(const char *aFilename, const char *aMode);
+void    parse_unicode_data(const char *aFilename);
+void    parse_east_asian_width(const char *aFilename);
+void    parse_derived_core_properties(const char *aFilename);
+void    apply_special_cases(void);
+void    build_tables(void);
+void    output_tables(void);
+int     parse_range(const char *aField, uint32_t *aFirst, uint32_t *aLast);
+char   *trim(char *aString);
+
+signed char *gWidth = NULL;            // Width class of every codepoint.
+char   *gAssigned = NULL;              // Non-zero for assigned codepoints.
+char    gVersion[MAX_LINE] = "(unknown)";
+
+uint8_t (*gChunk)[CHUNK] = NULL;       // Unique chunks of width + 1.
+size_t  gChunks = 0;
+uint16_t (*gBlock)[CHUNK] = NULL;      // Unique blocks of chunk indexes.
+size_t  gBlocks = 0;
+uint16_t gTop[BLOCKS];                 // Block index for codepoint >> 8.
+
+// Start the ball rolling.
+//
+int main(int aArgc, char **aArgv) {
+    int     ch;
+    while ((ch = getopt(aArgc, aArgv, "V")) != -1) {
+        switch (ch) {
+        case 'V':
+            printf("%s version %s\n", aArgv[0], VERSION);
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+    if (aArgc - optind != 3)
+        usage(EXIT_FAILURE);
+
+    gWidth = xmalloc(MAX_CODEPOINT * sizeof *gWidth);
+    gAssigned = xmalloc(MAX_CODEPOINT * sizeof *gAssigned);
+    memset(gAssigned, 0, MAX_CODEPOINT * sizeof *gAssigned);
+    for (uint32_t cp = 0; cp < MAX_CODEPOINT; ++cp)
+        gWidth[cp] = SINGLE_WIDTH;
+
+    parse_east_asian_width(aArgv[optind + 1]);
+    parse_unicode_data(aArgv[optind]);
+    parse_derived_core_properties(aArgv[optind + 2]);
+    apply_special_cases();
+    build_tables();
+    output_tables();
+    fprintf(stderr, "%zu chunks, %zu blocks\n", gChunks, gBlocks);
+    return EXIT_SUCCESS;
+}
+
+// Mark characters with East_Asian_Width W or F as double width.
+//
+void parse_east_asian_width(const char *aFilename) {
+    FILE   *const fp = xfopen(aFilename, "r");
+    char    line[MAX_LINE];
+    int     line_no = 0;
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        ++line_no;
+        if (line_no == 1 && line[0] == '#')
+            snprintf(gVersion, sizeof gVersion, "%s", trim(line + 1));
+        char   *const hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        char   *const semicolon = strchr(line, ';');
+        if (semicolon == NULL)
+            continue;
+        *semicolon = '\0';
+        uint32_t first, last;
+        if (!parse_range(line, &first, &last))
+            errx("%s, line %d: can't parse codepoint range\n", aFilename, line_no);
+        const char *const property = trim(semicolon + 1);
+        if (strcmp(property, "W") == 0 || strcmp(property, "F") == 0)
+            for (uint32_t cp = first; cp <= last; ++cp)
+                gWidth[cp] = DOUBLE_WIDTH;
+    }
+    fclose(fp);
+}
+
+// Record assigned codepoints and make control characters unprintable and
+// nonspacing marks, enclosing marks and format characters zero width.
+//
+void parse_unicode_data(const char *aFilename) {
+    FILE   *const fp = xfopen(aFilename, "r");
+    char    line[MAX_LINE];
+    int     line_no = 0;
+    uint32_t range_first = 0;
+    int     in_range = 0;
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        ++line_no;
+        char   *field[5];
+        char   *p = line;
+        for (int i = 0; i < 5; ++i) {
+            field[i] = p;
+            p = strchr(p, ';');
+            if (p == NULL)
+                errx("%s, line %d: expected at least 5 fields\n", aFilename, line_no);
+            *p++ = '\0';
+        }
+        uint32_t cp;
+        if (sscanf(field[0], "%" SCNx32, &cp) != 1 || cp >= MAX_CODEPOINT)
+            errx("%s, line %d: can't parse codepoint\n", aFilename, line_no);
+        uint32_t first = cp;
+        if (strstr(field[1], ", First>") != NULL) {
+            range_first = cp;
+            in_range = 1;
+            continue;
+        }
+        if (strstr(field[1], ", Last>") != NULL) {
+            if (!in_range)
+                errx("%s, line %d: range end without start\n", aFilename, line_no);
+            first = range_first;
+            in_range = 0;
+        }
+        const char *const category = field[2];
+        for (uint32_t c = first; c <= cp; ++c) {
+            if (strcmp(category, "Cs") == 0)
+                continue;       // Surrogates are not characters.
+            gAssigned[c] = 1;
+            if (strcmp(category, "Cc") == 0 || strcmp(category, "Zl") == 0 || strcmp(category, "Zp") == 0)
+                gWidth[c] = UNPRINTABLE;
+            else if (strcmp(category, "Mn") == 0 || strcmp(category, "Me") == 0 || strcmp(category, "Cf") == 0
+                     || strcmp(field[4], "NSM") == 0)
+                gWidth[c] = ZERO_WIDTH;
+        }
+    }
+    fclose(fp);
+}
+
+// Prepended concatenation marks are format characters that still take a cell.
+//
+void parse_derived_core_properties(const char *aFilename) {
+    FILE   *const fp = xfopen(aFilename, "r");
+    char    line[MAX_LINE];
+    int     line_no = 0;
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        ++line_no;
+        char   *const hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        char   *const semicolon = strchr(line, ';');
+        if (semicolon == NULL)
+            continue;
+        *semicolon = '\0';
+        if (strcmp(trim(semicolon + 1), "Prepended_Concatenation_Mark") != 0)
+            continue;
+        uint32_t first, last;
+        if (!parse_range(line, &first, &last))
+            errx("%s, line %d: can't parse codepoint range\n", aFilename, line_no);
+        for (uint32_t cp = first; cp <= last; ++cp)
+            gWidth[cp] = SINGLE_WIDTH;
+    }
+    fclose(fp);
+}
+
+// Special cases, as in glibc's localedata/unicode-gen/utf8_gen.py.
+//
+void apply_special_cases(void) {
+    gWidth[0x00AD] = SINGLE_WIDTH;     // SOFT HYPHEN is visible in terminals.
+    for (uint32_t cp = 0x1160; cp < 0x1200; ++cp)
+        gWidth[cp] = ZERO_WIDTH;       // Hangul Jamo medial vowels and final consonants.
+    for (uint32_t cp = 0xD7B0; cp < 0xD800; ++cp)
+        gWidth[cp] = ZERO_WIDTH;       // Hangul Jamo Extended-B, likewise.
+    for (uint32_t cp = 0x3248; cp < 0x3250; ++cp)
+        gWidth[cp] = DOUBLE_WIDTH;     // Circled numbers on black square.
+    for (uint32_t cp = 0x4DC0; cp < 0x4E00; ++cp)
+        gWidth[cp] = DOUBLE_WIDTH;     // Yijing hexagram symbols.
+    for (uint32_t cp = 0; cp < MAX_CODEPOINT; ++cp)
+        if (!gAssigned[cp])
+            gWidth[cp] = UNPRINTABLE;
+    gWidth[0] = ZERO_WIDTH;            // wcwidth(L'\0') is 0.
+}
+
+// Split the widths into chunks and blocks, storing each distinct one once.
+//
+void build_tables(void) {
+    gChunk = xmalloc(MAX_CODEPOINT / CHUNK * sizeof *gChunk);
+    gBlock = xmalloc(BLOCKS * sizeof *gBlock);
+    for (uint32_t b = 0; b < BLOCKS; ++b) {
+        uint16_t block[CHUNK];
+        for (uint32_t c = 0; c < CHUNK; ++c) {
+            uint8_t chunk[CHUNK];
+            for (uint32_t i = 0; i < CHUNK; ++i)
+                chunk[i] = (uint8_t) (gWidth[b * BLOCK + c * CHUNK + i] + 1);
+            size_t  k;
+            for (k = 0; k < gChunks; ++k)
+                if (memcmp(gChunk[k], chunk, sizeof chunk) == 0)
+                    break;
+            if (k == gChunks)
+                memcpy(gChunk[gChunks++], chunk, sizeof chunk);
+            block[c] = (uint16_t) k;
+        }
+        size_t  k;
+        for (k = 0; k < gBlocks; ++k)
+            if (memcmp(gBlock[k], block, sizeof block) == 0)
+                break;
+        if (k == gBlocks)
+            memcpy(gBlock[gBlocks++], block, sizeof block);
+        gTop[b] = (uint16_t) k;
+    }
+    if (gBlocks > 256)
+        errx("%zu blocks do not fit the uint8_t top level table\n", gBlocks);
+    if (gChunks > 65536)
+        errx("%zu chunks do not fit the uint16_t block table\n", gChunks);
+}
+
+// Write the tables and cell_width() as C source to stdout.
+//
+void output_tables(void) {
+    printf("/*\n");
+    printf(" * cellwidth.c - character cell width of Unicode codepoints\n");
+    printf(" *\n");
+    printf(" * Generated by ucdtowidth from %s.\n", gVersion);
+    printf(" * Do not edit; run 'make widths' instead.\n");
+    printf(" */\n");
+    printf("#include <stdint.h>\n\n");
+    printf("#include \"cellwidth.h\"\n\n");
+
+    printf("// Block index for each 256 codepoints.\n");
+    printf("static const uint8_t gWidthTop[%d] = {", BLOCKS);
+    for (uint32_t b = 0; b < BLOCKS; ++b)
+        printf("%s%u,", b % 16 == 0 ? "\n    " : " ", gTop[b]);
+    printf("\n};\n\n");
+
+    printf("// Chunk index for each 16 codepoints of a block.\n");
+    printf("static const uint16_t gWidthBlock[%zu][%d] = {\n", gBlocks, CHUNK);
+    for (size_t k = 0; k < gBlocks; ++k) {
+        printf("    {");
+        for (uint32_t c = 0; c < CHUNK; ++c)
+            printf("%s%u", c == 0 ? "" : ", ", gBlock[k][c]);
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("// Width + 1 of each codepoint in a chunk.\n");
+    printf("static const uint8_t gWidthChunk[%zu][%d] = {\n", gChunks, CHUNK);
+    for (size_t k = 0; k < gChunks; ++k) {
+        printf("    {");
+        for (uint32_t i = 0; i < CHUNK; ++i)
+            printf("%s%u", i == 0 ? "" : ", ", gChunk[k][i]);
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("// Return the number of cells aCodepoint takes up, like wcwidth() in a\n");
+    printf("// UTF-8 locale: -1 for control and unassigned codepoints, 0 for\n");
+    printf("// combining and format characters, 1 or 2 for everything else.\n");
+    printf("//\n");
+    printf("int cell_width(uint32_t aCodepoint) {\n");
+    printf("    if (aCodepoint >= 0x%X)\n", MAX_CODEPOINT);
+    printf("        return -1;\n");
+    printf("    const uint8_t block = gWidthTop[aCodepoint >> 8];\n");
+    printf("    const uint16_t chunk = gWidthBlock[block][(aCodepoint >> 4) & 0xF];\n");
+    printf("    return gWidthChunk[chunk][aCodepoint & 0xF] - 1;\n");
+    printf("}\n");
+}
+
+// Parse "XXXX" or "XXXX..YYYY". Return 1 on success, 0 otherwise.
+//
+int parse_range(const char *aField, uint32_t *aFirst, uint32_t *aLast) {
+    const int n = sscanf(aField, " %" SCNx32 "..%" SCNx32, aFirst, aLast);
+    if (n == 1)
+        *aLast = *aFirst;
+    return n >= 1 && *aFirst <= *aLast && *aLast < MAX_CODEPOINT;
+}
+
+// Strip leading and trailing white space in place.
+//
+char   *trim(char *aString) {
+    while (*aString == ' ' || *aString == '\t')
+        ++aString;
+    size_t  len = strlen(aString);
+    while (len > 0 && strchr(" \t\r\n", aString[len - 1]) != NULL)
+        aString[--len] = '\0';
+    return aString;
+}
+
+// Output usage message and exit with status.
+//
+void usage(int aStatus) {
+    fprintf(stderr, "usage: ucdtowidth [-V] UnicodeData.txt EastAsianWidth.txt DerivedCoreProperties.txt\n");
+    fprintf(stderr, "\nWrites C source for the cell_width() table to stdout\n");
+    exit(aStatus);
+}
+
+// Open file and exit on failure.
+//
+FILE   *xfopen(const char *aFilename, const char *aMode) {
+    FILE   *const fp = fopen(aFilename, aMode);
+    if (fp == NULL)
+        errx("can't open(%s,%s): %s\n", aFilename, aMode, strerror(errno));
+    return fp;
+}
+
+// Allocate memory and exit on failure.
+//
+void   *xmalloc(size_t aSize) {
+    void   *const mem = malloc(aSize);
+    if (mem == NULL)
+        errx("failed to allocate %zu bytes\n", aSize);
+    return mem;
+}
+
+// Print formatted message on stderr and exit.
+//
+void errx(const char *aFormat, ...) {
+    va_list ap;
+    va_start(ap, aFormat);
+    vfprintf(stderr, aFormat, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+/* vim: set tabstop=4 shiftwidth=4 expandtab fileformat=unix: */